@@ -0,0 +1,239 @@
+// SPDX-License-Identifier: CC0-1.0
+
+/*
+ * Encode and render throughput benchmark for qr.
+ *
+ * Prints one JSON record per line: QRcode_encodeString() and the built-in
+ * encoder (QrOptions.builtin) for every version and EC level,
+ * qr_data_to_text() for every version, EC level, layout and paint setting,
+ * and byte-minimal painted text (QrOptions.minimal) along with the size of
+ * the usual painted text it replaces.
+ *
+ */
+
+#include <qrencode.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qr.h"
+
+/* Minimum run time of each case, in milliseconds */
+#define BENCH_MIN_TIME_MS 20
+
+/* Payload short enough to fit version 1 at every EC level */
+#define BENCH_PAYLOAD "Hello"
+
+/* Newline character(s) */
+#define EOL "\n"
+
+typedef struct {
+    const char    *name;
+    unsigned char  large;
+    unsigned char  compact;
+} Layout;
+
+static const Layout layouts[] = {
+    { "default", 0, 0 },
+    { "compact", 0, 1 },
+    { "large",   1, 0 },
+};
+
+static const char ec_levels[] = { 'L', 'M', 'Q', 'H' };
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void print_record(const char *phase, const QRcode *code,
+                         const char ec_level, const Layout *layout,
+                         const int paint, const long iterations,
+                         const double elapsed_ns, const double bytes,
+                         const size_t baseline_bytes)
+{
+    const double modules = (double)code->width * code->width;
+    const double per_code_ns = elapsed_ns / iterations;
+
+    printf("{\"phase\":\"%s\",\"version\":%d,\"ec\":\"%c\"",
+           phase, code->version, ec_level);
+
+    if (layout != NULL) {
+        printf(",\"layout\":\"%s\",\"paint\":%s", layout->name,
+               (paint) ? "true" : "false");
+    }
+
+    printf(",\"iterations\":%ld,\"codes_per_sec\":%.1f,"
+           "\"ns_per_module\":%.3f,\"bytes_per_sec\":%.1f",
+           iterations, 1e9 / per_code_ns, per_code_ns / modules,
+           bytes * 1e9 / per_code_ns);
+
+    /* Size of the text against that of the usual renderer */
+    if (baseline_bytes > 0) {
+        printf(",\"bytes\":%.0f,\"baseline_bytes\":%lu", bytes,
+               (unsigned long)baseline_bytes);
+    }
+
+    printf("}" EOL);
+}
+
+static int bench_encode(const int version, const char ec_level,
+                        const int builtin, const double min_time_ns)
+{
+    const QRecLevel level = get_qr_ec_level(ec_level);
+    long iterations = 0;
+    double start = now_ns();
+    double elapsed = 0;
+    QRcode *code = NULL;
+    QrOptions options;
+
+    qr_options_init(&options);
+    options.version = version;
+    options.ec_level = ec_level;
+    options.builtin = builtin;
+
+    do {
+        QRcode_free(code);
+        code = (builtin) ? qr_encode(&options, BENCH_PAYLOAD,
+                                     strlen(BENCH_PAYLOAD))
+                         : QRcode_encodeString(BENCH_PAYLOAD, version, level,
+                                               QR_MODE_8, 1);
+
+        if (code == NULL) {
+            return 1;
+        }
+
+        iterations++;
+        elapsed = now_ns() - start;
+    } while (elapsed < min_time_ns);
+
+    print_record((builtin) ? "encode_builtin" : "encode", code, ec_level,
+                 NULL, 0, iterations, elapsed, strlen(BENCH_PAYLOAD), 0);
+    QRcode_free(code);
+
+    return 0;
+}
+
+static int bench_render(const QRcode *code, const char ec_level,
+                        const Layout *layout, const int paint,
+                        const double min_time_ns)
+{
+    long iterations = 0;
+    double start = now_ns();
+    double elapsed = 0;
+    size_t bytes = 0;
+    char *text;
+
+    do {
+        text = qr_data_to_text(code, 1, 0, paint, layout->large,
+                               layout->compact);
+
+        if (text == NULL) {
+            return 1;
+        }
+
+        bytes = strlen(text);
+        free(text);
+
+        iterations++;
+        elapsed = now_ns() - start;
+    } while (elapsed < min_time_ns);
+
+    print_record("render", code, ec_level, layout, paint, iterations, elapsed,
+                 bytes, 0);
+
+    return 0;
+}
+
+static int bench_minimal(const QRcode *code, const char ec_level,
+                         const Layout *layout, const double min_time_ns)
+{
+    long iterations = 0;
+    double start = now_ns();
+    double elapsed = 0;
+    size_t bytes = 0, baseline_bytes;
+    QrOptions options;
+    char *text;
+
+    qr_options_init(&options);
+    options.large = layout->large;
+    options.compact = layout->compact;
+
+    baseline_bytes = qr_render_size(&options, code);
+    options.minimal = 1;
+
+    do {
+        text = qr_render_text(&options, code);
+
+        if (text == NULL) {
+            return 1;
+        }
+
+        bytes = strlen(text);
+        free(text);
+
+        iterations++;
+        elapsed = now_ns() - start;
+    } while (elapsed < min_time_ns);
+
+    print_record("minimal", code, ec_level, layout, 1, iterations, elapsed,
+                 bytes, baseline_bytes);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const double min_time_ns = 1e6 * ((argc > 1) ? atoi(argv[1])
+                                                 : BENCH_MIN_TIME_MS);
+    size_t e, l;
+    int version, paint;
+    QRcode *code;
+
+    for (version = 1; version <= QRSPEC_VERSION_MAX; version++) {
+        for (e = 0; e < sizeof(ec_levels); e++) {
+            if (bench_encode(version, ec_levels[e], 0, min_time_ns) != 0 ||
+                bench_encode(version, ec_levels[e], 1, min_time_ns) != 0) {
+                fprintf(stderr, "Error: failed to generate QR code" EOL);
+                return 1;
+            }
+
+            code = QRcode_encodeString(BENCH_PAYLOAD, version,
+                                       get_qr_ec_level(ec_levels[e]),
+                                       QR_MODE_8, 1);
+            if (code == NULL) {
+                fprintf(stderr, "Error: failed to generate QR code" EOL);
+                return 1;
+            }
+
+            for (l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+                for (paint = 0; paint <= 1; paint++) {
+                    if (bench_render(code, ec_levels[e], &layouts[l], paint,
+                                     min_time_ns) != 0) {
+                        fprintf(stderr, "Error: failed to convert QR code "
+                                        "data into text" EOL);
+                        QRcode_free(code);
+                        return 1;
+                    }
+                }
+
+                if (bench_minimal(code, ec_levels[e], &layouts[l],
+                                  min_time_ns) != 0) {
+                    fprintf(stderr, "Error: failed to convert QR code "
+                                    "data into text" EOL);
+                    QRcode_free(code);
+                    return 1;
+                }
+            }
+
+            QRcode_free(code);
+        }
+    }
+
+    return 0;
+}
@@ -10,10 +10,13 @@ PROG = qr
 PREFIX = /usr/local
 
 # Libs
-LIBS = -lm -lqrencode
+LIBS = -lm -lpthread -lqrencode
 
 # Flags
 CFLAGS = -std=c99 -pedantic -Wall -Wextra -Wfatal-errors -pedantic-errors -O3 -D_XOPEN_SOURCE=500 -D_POSIX_C_SOURCE=200809L
 
 # Compiler
 CC = cc
+
+# Archiver
+AR = ar
@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: CC0-1.0
+
+/*
+ * Golden corpus check and performance gate for the text renderer.
+ *
+ * Renders synthetic module matrices of every QR Code version (and Micro QR
+ * Code version) with every border width and every combination of invert,
+ * paint, large and compact through qr_data_to_text(), and either compares
+ * the size and hash of each text with the corpus or writes the corpus out.
+ * Matrices are generated here rather than encoded, so the corpus only ever
+ * changes along with the renderer, whatever the libqrencode version.
+ *
+ * The performance gate times rendering at a few versions for every
+ * combination of flags, and fails if they got slower than the stored
+ * baseline by more than a threshold overall (the geometric mean of the
+ * ratios, single cases being too noisy to gate on by themselves).
+ *
+ */
+
+#include <math.h>
+#include <qrencode.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qr.h"
+
+/* Micro QR Code versions come before the QR Code ones (M1-M4, 1-40) */
+#define MICRO_VERSIONS 4
+#define VERSIONS       (MICRO_VERSIONS + QRSPEC_VERSION_MAX)
+
+#define BORDER_MAX 4
+#define FLAG_COUNT 16 // Invert, paint, large, compact
+
+/* Rendering is timed for this long (in milliseconds) per case */
+#define PERF_MIN_TIME_MS 50
+
+/* Default slowdown (in percent) the performance gate lets through */
+#define PERF_THRESHOLD 10
+
+#define LINE_SIZE_MAX 128
+
+/* Newline character(s) */
+#define EOL "\n"
+
+static const int perf_versions[] = { 1, 10, 25, 40 };
+
+static int version_width(const int version)
+{
+    return (version <= MICRO_VERSIONS) ? 9 + 2 * version
+                                       : 17 + 4 * (version - MICRO_VERSIONS);
+}
+
+static void version_name(const int version, char *name)
+{
+    if (version <= MICRO_VERSIONS) {
+        sprintf(name, "M%d", version);
+    } else {
+        sprintf(name, "%d", version - MICRO_VERSIONS);
+    }
+}
+
+static void flags_name(const int flags, char *name)
+{
+    name[0] = (flags & 1) ? 'i' : '-';
+    name[1] = (flags & 2) ? 'p' : '-';
+    name[2] = (flags & 4) ? 'l' : '-';
+    name[3] = (flags & 8) ? 'c' : '-';
+    name[4] = '\0';
+}
+
+/* Pseudo-random modules (xorshift), the same on every platform */
+static void matrix_fill(QRcode *code, const int version)
+{
+    uint32_t state = 2463534242u + version;
+    int i;
+
+    code->version = version;
+    code->width = version_width(version);
+
+    for (i = 0; i < code->width * code->width; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        /* Libqrencode keeps other flags in the upper bits */
+        code->data[i] = (unsigned char)((state >> 7) & 0xFE) |
+                        ((state >> 3) & 1);
+    }
+}
+
+static char *render(const QRcode *code, const int border, const int flags)
+{
+    return qr_data_to_text(code, border, flags & 1, (flags >> 1) & 1,
+                           (flags >> 2) & 1, (flags >> 3) & 1);
+}
+
+/* Write the corpus (if out is set), or compare it with the one from in */
+static int golden(FILE *in, FILE *out)
+{
+    unsigned char data[177 * 177];
+    QRcode code = { .data = data };
+    char line[LINE_SIZE_MAX], expected[LINE_SIZE_MAX];
+    char version_str[16], flags_str[8];
+    int version, border, flags;
+    size_t cases = 0, failures = 0;
+    char *text;
+
+    for (version = 1; version <= VERSIONS; version++) {
+        matrix_fill(&code, version);
+        version_name(version, version_str);
+
+        for (border = 1; border <= BORDER_MAX; border++) {
+            for (flags = 0; flags < FLAG_COUNT; flags++) {
+                text = render(&code, border, flags);
+                if (text == NULL) {
+                    fprintf(stderr, "Error: failed to convert QR code data "
+                                    "into text" EOL);
+                    return 1;
+                }
+
+                flags_name(flags, flags_str);
+                sprintf(line, "%s %d %s %lu %016llx" EOL, version_str,
+                        border, flags_str, (unsigned long)strlen(text),
+                        (unsigned long long)qr_hash(text, strlen(text),
+                                                    QR_HASH_BASIS));
+                free(text);
+                cases++;
+
+                if (out != NULL) {
+                    fputs(line, out);
+                    continue;
+                }
+
+                if (fgets(expected, sizeof(expected), in) == NULL) {
+                    expected[0] = '\0';
+                }
+
+                if (strcmp(line, expected) != 0) {
+                    if (failures++ < 10) {
+                        fprintf(stderr, "Mismatch: %s      (corpus: %s)" EOL,
+                                strtok(line, EOL), strtok(expected, EOL));
+                    }
+                }
+            }
+        }
+    }
+
+    if (out == NULL) {
+        if (fgets(expected, sizeof(expected), in) != NULL) {
+            fprintf(stderr, "Error: the corpus has more cases than %lu" EOL,
+                    (unsigned long)cases);
+            return 1;
+        }
+
+        printf("%lu of %lu cases byte-identical" EOL,
+               (unsigned long)(cases - failures), (unsigned long)cases);
+    }
+
+    return failures > 0;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Fastest of a few runs of at least min_time_ns, in nanoseconds per code */
+static double perf_time(const QRcode *code, const int flags,
+                        const double min_time_ns)
+{
+    double best = 0;
+    double start, elapsed;
+    long iterations;
+    int run;
+
+    for (run = 0; run < 3; run++) {
+        iterations = 0;
+        start = now_ns();
+
+        do {
+            free(render(code, 1, flags));
+            iterations++;
+            elapsed = now_ns() - start;
+        } while (elapsed < min_time_ns / 3);
+
+        if (run == 0 || elapsed / iterations < best) {
+            best = elapsed / iterations;
+        }
+    }
+
+    return best;
+}
+
+/*
+    Write the baseline (if out is set), or compare with the one from in and
+    fail if slower than it by more than threshold percent overall
+*/
+static int perf(FILE *in, FILE *out, const double threshold,
+                const double min_time_ns)
+{
+    unsigned char data[177 * 177];
+    QRcode code = { .data = data };
+    char version_str[16], flags_str[8];
+    char expected_version[16], expected_flags[8];
+    double ns, expected_ns, change;
+    double log_ratios = 0;
+    size_t v;
+    int flags, cases = 0;
+
+    for (v = 0; v < sizeof(perf_versions) / sizeof(perf_versions[0]); v++) {
+        matrix_fill(&code, perf_versions[v] + MICRO_VERSIONS);
+        version_name(perf_versions[v] + MICRO_VERSIONS, version_str);
+
+        for (flags = 0; flags < FLAG_COUNT; flags++) {
+            flags_name(flags, flags_str);
+            ns = perf_time(&code, flags, min_time_ns);
+
+            if (out != NULL) {
+                fprintf(out, "%s %s %.1f" EOL, version_str, flags_str, ns);
+                continue;
+            }
+
+            if (fscanf(in, "%15s %7s %lf", expected_version, expected_flags,
+                       &expected_ns) != 3 ||
+                strcmp(expected_version, version_str) != 0 ||
+                strcmp(expected_flags, flags_str) != 0) {
+                fprintf(stderr, "Error: the baseline does not match the "
+                                "cases, write it again" EOL);
+                return 1;
+            }
+
+            change = (ns / expected_ns - 1) * 100;
+            printf("%-3s %s %10.1f ns/code %+7.1f%%" EOL, version_str,
+                   flags_str, ns, change);
+
+            log_ratios += log(ns / expected_ns);
+            cases++;
+        }
+    }
+
+    if (out != NULL) {
+        return 0;
+    }
+
+    change = (exp(log_ratios / cases) - 1) * 100;
+    printf("Overall %+.1f%% (threshold %+.0f%%)" EOL, change, threshold);
+
+    if (change > threshold) {
+        fprintf(stderr, "Error: rendering got slower than the baseline" EOL);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mode = (argc > 1) ? argv[1] : "";
+    FILE *file;
+    int ret;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: qr-golden check|write CORPUS" EOL
+                        "  or:  qr-golden perf|perf-write BASELINE "
+                        "[THRESHOLD] [TIME]" EOL);
+        return 1;
+    }
+
+    file = fopen(argv[2], (strstr(mode, "write") != NULL) ? "w" : "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: unable to open %s" EOL, argv[2]);
+        return 1;
+    }
+
+    if (strcmp(mode, "check") == 0) {
+        ret = golden(file, NULL);
+    } else if (strcmp(mode, "write") == 0) {
+        ret = golden(NULL, file);
+    } else if (strcmp(mode, "perf") == 0 || strcmp(mode, "perf-write") == 0) {
+        const double threshold = (argc > 3 && *argv[3] != '\0') ?
+                                 atof(argv[3]) : PERF_THRESHOLD;
+        const double min_time_ns = 1e6 * ((argc > 4 && *argv[4] != '\0') ?
+                                          atoi(argv[4]) : PERF_MIN_TIME_MS);
+
+        ret = perf((strcmp(mode, "perf") == 0) ? file : NULL,
+                   (strcmp(mode, "perf") == 0) ? NULL : file, threshold,
+                   min_time_ns);
+    } else {
+        fprintf(stderr, "Error: unknown mode %s" EOL, mode);
+        ret = 1;
+    }
+
+    if (fclose(file) != 0) {
+        ret = 1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,5140 @@
+// SPDX-License-Identifier: CC0-1.0
+
+/*
+ * QR Code is a registered trademark of DENSO WAVE INCORPORATED in Japan
+ * and other countries.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <qrencode.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "qr.h"
+
+/* Single-module blocks (large size) */
+#define BLOCK_0 "  "
+#define BLOCK_1 "██"
+/* Single-module blocks (large size, compact mode) */
+#define BLOCK_0_C " "
+#define BLOCK_1_C "█"
+/* Double-module blocks (default size, normal mode) */
+/*
+    Module bit order: [ bottom | top ]
+*/
+#define DBL_BLOCK_00 " "
+#define DBL_BLOCK_01 "▀"
+#define DBL_BLOCK_10 "▄"
+#define DBL_BLOCK_11 "█"
+/* Quad-module blocks (default size, compact mode) */
+/*
+    Module bit order: [ bottom_right | top_right | bottom_left | top_left ]
+*/
+#define QUAD_BLOCK_0000 " "
+#define QUAD_BLOCK_0001 "▘"
+#define QUAD_BLOCK_0010 "▖"
+#define QUAD_BLOCK_0011 "▌"
+#define QUAD_BLOCK_0100 "▝"
+#define QUAD_BLOCK_1000 "▗"
+#define QUAD_BLOCK_1001 "▚"
+#define QUAD_BLOCK_1010 "▄"
+#define QUAD_BLOCK_0101 "▀"
+#define QUAD_BLOCK_O110 "▞"
+#define QUAD_BLOCK_0111 "▛"
+#define QUAD_BLOCK_1011 "▙"
+#define QUAD_BLOCK_1100 "▐"
+#define QUAD_BLOCK_1101 "▜"
+#define QUAD_BLOCK_1110 "▟"
+#define QUAD_BLOCK_1111 "█"
+
+/* ANSI terminal colors */
+#define FG_WH     "\x1b[37m"
+#define FG_DF     "\x1b[39m"
+#define BG_BK     "\x1b[40m"
+#define BG_DF     "\x1b[49m"
+#define BGBK_FGWH BG_BK FG_WH
+#define BGDF_FGDF BG_DF FG_DF
+
+/* Newline character(s) */
+#define EOL "\n"
+
+/* Width of the largest QR code (in modules) */
+#define QR_WIDTH_MAX (17 + 4 * QRSPEC_VERSION_MAX)
+
+/* Upper bound for the size of one rendered row of text */
+/*
+    Widest symbol plus widest border, made of the widest glyph,
+    with room for all palette codes and the newline
+*/
+#define TEXT_ROW_SIZE_MAX \
+    ((QR_WIDTH_MAX + 2 * 4) * (sizeof(BLOCK_1) - 1) + 64)
+
+/* Bit-packed module rows: one bit per module, one row of padding around */
+#define PLANE_ROWS_MAX   (QR_WIDTH_MAX + 2)
+#define PLANE_STRIDE_MAX ((QR_WIDTH_MAX + 1 + 7) / 8 + 1)
+
+/* Most characters a single symbol can hold (version 40-L, numeric mode) */
+#define QR_DATA_MAX 7089
+
+/* Upper limit for the raster scale (pixels per module) */
+/*
+    Keeps every module row of PNG scanlines within a single stored
+    deflate block (at most 65535 bytes)
+*/
+#define RASTER_SCALE_MAX 32
+
+/* Widest raster scanline, in pixels */
+#define RASTER_WIDTH_MAX ((QR_WIDTH_MAX + 2 * 4) * RASTER_SCALE_MAX)
+
+/* Structured append header (mode, symbol index, count and parity) */
+#define STRUCTURED_HEADER_BITS 20
+
+/* ECI designator of UTF-8 */
+#define ECI_UTF8 26
+
+/* Render cache store file layout */
+#define CACHE_FILE_MAGIC      "QRCACHE1"
+#define CACHE_FILE_HEADER     64
+#define CACHE_FILE_REVISION   2 /* Bump whenever rendered text or keys change */
+#define CACHE_FILE_SLOTS      4096
+#define CACHE_FILE_SLOT_SIZE  8192
+
+/* Option bytes that make up the cache key along with the payload */
+#define CACHE_KEY_OPTIONS 16
+
+typedef unsigned char bool;
+#define true          1
+#define false         0
+
+/* Use binary code to represent modules when referring to blocks */
+#define B_0    0
+#define B_1    1
+#define B_00   B_0
+#define B_01   B_1
+#define B_10   2
+#define B_11   3
+#define B_0000 B_0
+#define B_0001 B_1
+#define B_0010 B_10
+#define B_0011 B_11
+#define B_0100 4
+#define B_0101 5
+#define B_0110 6
+#define B_0111 7
+#define B_1000 8
+#define B_1001 9
+#define B_1010 10
+#define B_1011 11
+#define B_1100 12
+#define B_1101 13
+#define B_1110 14
+#define B_1111 15
+
+/* Unicode BOM */
+static const char *utf8_bom = "\xEF\xBB\xBF";
+
+#define UTF8_BOM_SIZE 3
+
+static inline bool data_has_utf8_bom(const char *data, const size_t size)
+{
+    return (size >= UTF8_BOM_SIZE && memcmp(data, utf8_bom, UTF8_BOM_SIZE) == 0);
+}
+
+/* Heap allocations, counted for qr_alloc_stats() */
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long alloc_count = 0;
+static unsigned long alloc_bytes = 0;
+
+static void alloc_counted(const size_t size)
+{
+    pthread_mutex_lock(&alloc_lock);
+    alloc_count++;
+    alloc_bytes += size;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+void *qr_malloc(const size_t size)
+{
+    alloc_counted(size);
+    return malloc(size);
+}
+
+void *qr_calloc(const size_t count, const size_t size)
+{
+    alloc_counted(count * size);
+    return calloc(count, size);
+}
+
+void *qr_realloc(void *ptr, const size_t size)
+{
+    alloc_counted(size);
+    return realloc(ptr, size);
+}
+
+uint64_t qr_hash(const void *bytes, const size_t size, uint64_t hash)
+{
+    const unsigned char *byte = bytes;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ byte[i]) * UINT64_C(0x100000001B3);
+    }
+
+    return hash;
+}
+
+void qr_alloc_stats(unsigned long *allocs, unsigned long *bytes)
+{
+    pthread_mutex_lock(&alloc_lock);
+    *allocs = alloc_count;
+    *bytes = alloc_bytes;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/* Scratch arena */
+/*
+    Scratch memory for encoding and rendering a code comes from an arena
+    of the calling thread, and is given back (down to a mark) as soon as
+    the code is done. Whatever does not fit the arena's block gets
+    allocated on the side, and once the arena is empty again its block
+    grows past the most it ever held, so codes no larger than those already
+    seen take no heap allocation at all
+*/
+#define ARENA_ALIGN 16
+
+/* Allocation that did not fit the block, at offset used */
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t             offset;
+} ArenaChunk;
+
+typedef struct {
+    char       *block;
+    size_t      capacity;
+    size_t      used;   // Offset of the next allocation
+    size_t      peak;   // Most ever used
+    ArenaChunk *chunks; // Most recent first
+} Arena;
+
+#define ARENA_CHUNK_HEADER \
+    ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static bool arena_key_ok = false;
+
+static void arena_destroy(void *arg)
+{
+    Arena *arena = arg;
+    ArenaChunk *chunk;
+
+    while ((chunk = arena->chunks) != NULL) {
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+
+    free(arena->block);
+    free(arena);
+}
+
+static void arena_key_create(void)
+{
+    arena_key_ok = (pthread_key_create(&arena_key, arena_destroy) == 0);
+}
+
+/* Arena of the calling thread (NULL if it cannot have one) */
+static Arena *arena_get(void)
+{
+    Arena *arena;
+
+    pthread_once(&arena_once, arena_key_create);
+    if (!arena_key_ok) {
+        return NULL;
+    }
+
+    arena = pthread_getspecific(arena_key);
+    if (arena == NULL) {
+        arena = qr_calloc(1, sizeof(Arena));
+
+        if (arena != NULL && pthread_setspecific(arena_key, arena) != 0) {
+            free(arena);
+            arena = NULL;
+        }
+    }
+
+    return arena;
+}
+
+static void *arena_alloc(Arena *arena, const size_t size)
+{
+    const size_t aligned = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    size_t offset;
+    ArenaChunk *chunk;
+
+    if (arena == NULL || aligned < size) {
+        return NULL;
+    }
+
+    offset = arena->used;
+
+    arena->used += aligned;
+    if (arena->used > arena->peak) {
+        arena->peak = arena->used;
+    }
+
+    if (arena->used <= arena->capacity) {
+        return arena->block + offset;
+    }
+
+    chunk = qr_malloc(ARENA_CHUNK_HEADER + aligned);
+    if (chunk == NULL) {
+        arena->used = offset;
+        return NULL;
+    }
+
+    chunk->next = arena->chunks;
+    chunk->offset = offset;
+    arena->chunks = chunk;
+
+    return (char *)chunk + ARENA_CHUNK_HEADER;
+}
+
+/* Give back everything allocated since the arena was at mark */
+static void arena_release(Arena *arena, const size_t mark)
+{
+    ArenaChunk *chunk;
+    char *block;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    while ((chunk = arena->chunks) != NULL && chunk->offset >= mark) {
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+
+    arena->used = mark;
+
+    /*
+        Make room for twice the most it held while nothing points into it,
+        as sizes vary a little from one code to the next
+    */
+    if (mark == 0 && arena->peak > arena->capacity) {
+        block = qr_malloc(arena->peak * 2);
+
+        if (block != NULL) {
+            free(arena->block);
+            arena->block = block;
+            arena->capacity = arena->peak * 2;
+        }
+    }
+}
+
+static inline size_t arena_mark(const Arena *arena)
+{
+    return (arena != NULL) ? arena->used : 0;
+}
+
+/* Text output cursor (only measures output length while text is NULL) */
+/*
+    Text is a buffer of capacity bytes. When fd is set it gets flushed to fd
+    between rows, so rendering never holds more than that; otherwise writing
+    stops once it is full, and the rest of the text is only measured
+*/
+typedef struct {
+    char          *text;
+    size_t         length;
+    size_t         capacity;
+    int            fd;
+    bool           failed;
+} TextWriter;
+
+#define TEXT_WRITE_STR(writer, str) text_write(writer, str, sizeof(str) - 1)
+
+static bool fd_write_all(const int fd, const char *bytes, const size_t size)
+{
+    size_t offset = 0;
+    ssize_t written;
+
+    while (offset < size) {
+        written = write(fd, bytes + offset, size - offset);
+
+        if (written < 0) {
+            if (errno != EINTR) {
+                return false;
+            }
+        } else {
+            offset += written;
+        }
+    }
+
+    return true;
+}
+
+static bool text_writer_flush(TextWriter *writer)
+{
+    if (!writer->failed && !fd_write_all(writer->fd, writer->text,
+                                         writer->length)) {
+        writer->failed = true;
+    }
+
+    writer->length = 0;
+
+    return !writer->failed;
+}
+
+static inline void text_write(TextWriter *writer, const char *bytes,
+                              const size_t size)
+{
+    if (writer->text != NULL) {
+        if (writer->length + size > writer->capacity) {
+            if (writer->fd < 0) {
+                /* Out of room, keep on measuring only */
+                writer->text = NULL;
+                writer->length += size;
+                return;
+            }
+
+            text_writer_flush(writer);
+
+            /* Too large to ever be buffered, pass it straight through */
+            if (size > writer->capacity) {
+                if (!writer->failed && !fd_write_all(writer->fd, bytes, size)) {
+                    writer->failed = true;
+                }
+
+                return;
+            }
+        }
+
+        memcpy(writer->text + writer->length, bytes, size);
+    }
+
+    writer->length += size;
+}
+
+static inline void text_write_eol(TextWriter *writer)
+{
+    TEXT_WRITE_STR(writer, EOL);
+
+    /* Flush once the buffer can no longer fit another whole row */
+    if (writer->fd >= 0 &&
+        writer->capacity - writer->length < TEXT_ROW_SIZE_MAX) {
+        text_writer_flush(writer);
+    }
+}
+
+/* Glyph tables */
+/*
+    Glyphs of every block index are stored at a fixed width, so that the
+    renderer copies whole entries without looking at their length and then
+    only advances by the actual size of the glyph
+*/
+#define GLYPH_SIZE 8
+
+typedef struct {
+    char          bytes[16][GLYPH_SIZE];
+    unsigned char sizes[16];
+} GlyphTable;
+
+#define GLYPH_SIZE_OF(glyph) (sizeof(glyph) - 1)
+
+#define GLYPHS_2(g0, g1) \
+    { { g0, g1 }, { GLYPH_SIZE_OF(g0), GLYPH_SIZE_OF(g1) } }
+
+#define GLYPHS_4(g0, g1, g2, g3) \
+    { { g0, g1, g2, g3 }, \
+      { GLYPH_SIZE_OF(g0), GLYPH_SIZE_OF(g1), GLYPH_SIZE_OF(g2), \
+        GLYPH_SIZE_OF(g3) } }
+
+#define GLYPHS_16(g0, g1, g2, g3, g4, g5, g6, g7, \
+                  g8, g9, g10, g11, g12, g13, g14, g15) \
+    { { g0, g1, g2, g3, g4, g5, g6, g7, g8, g9, g10, g11, g12, g13, g14, \
+        g15 }, \
+      { GLYPH_SIZE_OF(g0), GLYPH_SIZE_OF(g1), GLYPH_SIZE_OF(g2), \
+        GLYPH_SIZE_OF(g3), GLYPH_SIZE_OF(g4), GLYPH_SIZE_OF(g5), \
+        GLYPH_SIZE_OF(g6), GLYPH_SIZE_OF(g7), GLYPH_SIZE_OF(g8), \
+        GLYPH_SIZE_OF(g9), GLYPH_SIZE_OF(g10), GLYPH_SIZE_OF(g11), \
+        GLYPH_SIZE_OF(g12), GLYPH_SIZE_OF(g13), GLYPH_SIZE_OF(g14), \
+        GLYPH_SIZE_OF(g15) } }
+
+/* Text layouts */
+typedef enum {
+    TEXT_LAYOUT_NORMAL,        // Two modules per block
+    TEXT_LAYOUT_COMPACT,       // Four modules per block
+    TEXT_LAYOUT_LARGE,         // One module per two characters
+    TEXT_LAYOUT_LARGE_COMPACT, // One module per character
+    TEXT_LAYOUT_COUNT
+} TextLayout;
+
+/* Glyphs by layout and color inversion */
+static const GlyphTable glyph_tables[TEXT_LAYOUT_COUNT][2] = {
+    [TEXT_LAYOUT_NORMAL] = {
+        GLYPHS_4(DBL_BLOCK_11, DBL_BLOCK_01, DBL_BLOCK_10, DBL_BLOCK_00),
+        GLYPHS_4(DBL_BLOCK_00, DBL_BLOCK_10, DBL_BLOCK_01, DBL_BLOCK_11),
+    },
+    [TEXT_LAYOUT_COMPACT] = {
+        GLYPHS_16(QUAD_BLOCK_1111, QUAD_BLOCK_1110, QUAD_BLOCK_1101,
+                  QUAD_BLOCK_1100, QUAD_BLOCK_1011, QUAD_BLOCK_1010,
+                  QUAD_BLOCK_1001, QUAD_BLOCK_1000, QUAD_BLOCK_0111,
+                  QUAD_BLOCK_O110, QUAD_BLOCK_0101, QUAD_BLOCK_0100,
+                  QUAD_BLOCK_0011, QUAD_BLOCK_0010, QUAD_BLOCK_0001,
+                  QUAD_BLOCK_0000),
+        GLYPHS_16(QUAD_BLOCK_0000, QUAD_BLOCK_0001, QUAD_BLOCK_0010,
+                  QUAD_BLOCK_0011, QUAD_BLOCK_0100, QUAD_BLOCK_0101,
+                  QUAD_BLOCK_O110, QUAD_BLOCK_0111, QUAD_BLOCK_1000,
+                  QUAD_BLOCK_1001, QUAD_BLOCK_1010, QUAD_BLOCK_1011,
+                  QUAD_BLOCK_1100, QUAD_BLOCK_1101, QUAD_BLOCK_1110,
+                  QUAD_BLOCK_1111),
+    },
+    [TEXT_LAYOUT_LARGE] = {
+        GLYPHS_2(BLOCK_1, BLOCK_0),
+        GLYPHS_2(BLOCK_0, BLOCK_1),
+    },
+    [TEXT_LAYOUT_LARGE_COMPACT] = {
+        GLYPHS_2(BLOCK_1_C, BLOCK_0_C),
+        GLYPHS_2(BLOCK_0_C, BLOCK_1_C),
+    },
+};
+
+static inline void text_write_glyph(TextWriter *writer,
+                                    const GlyphTable *glyphs,
+                                    const unsigned char block)
+{
+    text_write(writer, glyphs->bytes[block], glyphs->sizes[block]);
+}
+
+/* Module matrix packed into rows of bits, zero-padded on every side */
+/*
+    Module (row, col) of the QR code is stored in bits[row + pad_top],
+    bit (col + pad_left); everything outside of the code reads as 0
+*/
+typedef struct {
+    unsigned char bits[PLANE_ROWS_MAX][PLANE_STRIDE_MAX];
+    int           pad_top;
+} ModulePlane;
+
+static void module_plane_pack(ModulePlane *plane, const QRcode *code,
+                              const int pad_top, const int pad_left)
+{
+    const int resolution = code->width;
+    int row, col, k;
+
+    memset(plane->bits, 0, sizeof(plane->bits[0]) * (resolution + 2));
+    plane->pad_top = pad_top;
+
+    for (row = 0; row < resolution; row++) {
+        const unsigned char *data = code->data + row * resolution;
+        unsigned char *bits = plane->bits[row + pad_top];
+        unsigned int carry = 0;
+
+        for (col = 0; col < resolution; col += 8) {
+            uint64_t word = 0;
+
+            /* Gather (up to) eight module bytes into one word */
+            for (k = 0; k < 8 && col + k < resolution; k++) {
+                word |= (uint64_t)data[col + k] << (k * 8);
+            }
+
+            /* Move lowest bit of byte n into bit 56 + n, then pack them */
+            carry |= (unsigned int)(((word & UINT64_C(0x0101010101010101)) *
+                                     UINT64_C(0x0102040810204080)) >> 56)
+                     << pad_left;
+            *bits++ = carry & 0xFF;
+            carry >>= 8;
+        }
+
+        *bits = carry;
+    }
+}
+
+/* Spread bit n of the byte into the lowest bit of byte n of the word */
+static inline uint64_t spread_bits(const unsigned char byte)
+{
+    return ((((byte * UINT64_C(0x0101010101010101)) &
+              UINT64_C(0x8040201008040201)) + UINT64_C(0x7F7F7F7F7F7F7F7F)) &
+            UINT64_C(0x8080808080808080)) >> 7;
+}
+
+/* Compute double-module block indices for the two rows starting at iv */
+static void module_plane_dbl_blocks(const ModulePlane *plane, const int iv,
+                                    const int cells, unsigned char *indices)
+{
+    const unsigned char *top = plane->bits[iv + plane->pad_top];
+    const unsigned char *bottom = plane->bits[iv + plane->pad_top + 1];
+    int i, k;
+
+    for (i = 0; i < cells; i += 8) {
+        /* Eight [ bottom | top ] indices at once, one per byte */
+        const uint64_t word = (spread_bits(top[i >> 3]) << 1) |
+                              spread_bits(bottom[i >> 3]);
+
+        for (k = 0; k < 8 && i + k < cells; k++) {
+            indices[i + k] = (word >> (k * 8)) & B_11;
+        }
+    }
+}
+
+/* Compute quad-module block indices for the two rows starting at iv */
+static void module_plane_quad_blocks(const ModulePlane *plane, const int iv,
+                                     const int cells, unsigned char *indices)
+{
+    const unsigned char *top = plane->bits[iv + plane->pad_top];
+    const unsigned char *bottom = plane->bits[iv + plane->pad_top + 1];
+    int i, k;
+
+    for (i = 0; i < cells; i += 4) {
+        /* Even bytes hold left [ bottom | top ], odd bytes the right ones */
+        uint64_t word = spread_bits(top[i >> 2]) |
+                        (spread_bits(bottom[i >> 2]) << 1);
+        /* Merge each right pair into its left neighbour byte */
+        word |= word >> 6;
+
+        for (k = 0; k < 4 && i + k < cells; k++) {
+            indices[i + k] = (word >> (k * 16)) & B_1111;
+        }
+    }
+}
+
+/* Compute single-module block indices for the row iv */
+static void module_plane_single_blocks(const ModulePlane *plane, const int iv,
+                                       const int cells, unsigned char *indices)
+{
+    const unsigned char *bits = plane->bits[iv + plane->pad_top];
+    int i, k;
+
+    for (i = 0; i < cells; i += 8) {
+        const uint64_t word = spread_bits(bits[i >> 3]);
+
+        for (k = 0; k < 8 && i + k < cells; k++) {
+            indices[i + k] = (word >> (k * 8)) & B_1;
+        }
+    }
+}
+
+/* Pre-rendered pieces of text rows */
+/*
+    Everything but the data blocks is the same for every row of a code, so
+    it is rendered once per code: the border rows whole, and the left and
+    right ends of data rows (palette, border blocks and palette reset)
+*/
+#define TEXT_PIECE_SIZE_MAX 64
+
+typedef struct {
+    const GlyphTable *glyphs;
+    void (*blocks)(const ModulePlane *plane, const int iv, const int cells,
+                   unsigned char *indices);
+    int    cells;      // Data blocks per row
+    char   head[TEXT_PIECE_SIZE_MAX];
+    size_t head_size;
+    char   tail[TEXT_PIECE_SIZE_MAX];
+    size_t tail_size;
+    char   border[TEXT_ROW_SIZE_MAX];
+    size_t border_size;
+    char   edge[TEXT_ROW_SIZE_MAX]; // Half-block bottom border row
+    size_t edge_size;
+} TextRows;
+
+static void text_piece_begin(TextWriter *piece, char *text,
+                             const size_t capacity)
+{
+    piece->text = text;
+    piece->length = 0;
+    piece->capacity = capacity;
+    piece->fd = -1;
+    piece->failed = false;
+}
+
+/* Data row: its data blocks between the pre-rendered ends */
+static inline void text_write_row(TextWriter *writer, const TextRows *rows,
+                                  const unsigned char *indices)
+{
+    const GlyphTable *glyphs = rows->glyphs;
+    char row[TEXT_ROW_SIZE_MAX + GLYPH_SIZE];
+    /* Render straight into the buffer if the row (and slack) fits */
+    const bool in_place = (writer->text != NULL &&
+                           writer->capacity - writer->length >=
+                           sizeof(row));
+    char *begin = (in_place) ? writer->text + writer->length : row;
+    char *p = begin;
+    int ih;
+
+    memcpy(p, rows->head, rows->head_size);
+    p += rows->head_size;
+
+    for (ih = 0; ih < rows->cells; ih++) {
+        memcpy(p, glyphs->bytes[indices[ih]], GLYPH_SIZE);
+        p += glyphs->sizes[indices[ih]];
+    }
+
+    memcpy(p, rows->tail, rows->tail_size);
+    p += rows->tail_size;
+
+    if (in_place) {
+        writer->length += p - begin;
+    } else {
+        text_write(writer, row, p - row);
+    }
+}
+
+static void qr_data_write_text(TextWriter *writer, const QRcode *code,
+                               const char border_width,
+                               const bool invert_colors, const bool paint,
+                               const bool large_size, const bool compact_mode)
+{
+    const TextLayout layout =
+        (large_size) ?
+            (compact_mode) ? TEXT_LAYOUT_LARGE_COMPACT : TEXT_LAYOUT_LARGE :
+            (compact_mode) ? TEXT_LAYOUT_COMPACT : TEXT_LAYOUT_NORMAL;
+    const char modules_per_block_v = (large_size) ? 1 : 2;
+    const char modules_per_block_h = (layout == TEXT_LAYOUT_COMPACT) ? 2 : 1;
+    /* Half border row and column become zero padding of the plane */
+    const char border_leftover_v = border_width % modules_per_block_v;
+    const char border_leftover_h = border_width % modules_per_block_h;
+
+    const int resolution = code->width;
+    const int l = resolution + border_width * 2;
+    const int border_blocks = (l - border_leftover_h + modules_per_block_h - 1) /
+                              modules_per_block_h;
+    const int side_blocks = (border_width - border_leftover_h +
+                             modules_per_block_h - 1) / modules_per_block_h;
+    const GlyphTable *glyphs = &glyph_tables[layout][invert_colors != 0];
+    const size_t side_size = side_blocks * glyphs->sizes[B_0];
+
+    TextRows rows;
+    TextWriter piece;
+    ModulePlane plane;
+    unsigned char indices[QR_WIDTH_MAX];
+    int ih = 0; // Horizontal index counter
+    int iv = 0; // Vertical index counter
+
+    rows.glyphs = glyphs;
+    rows.cells = (resolution + border_leftover_h + modules_per_block_h - 1) /
+                 modules_per_block_h;
+    rows.blocks = (layout == TEXT_LAYOUT_NORMAL) ? module_plane_dbl_blocks :
+                  (layout == TEXT_LAYOUT_COMPACT) ? module_plane_quad_blocks :
+                                                    module_plane_single_blocks;
+
+    /* Left end of data rows: palette and left border blocks */
+    text_piece_begin(&piece, rows.head, sizeof(rows.head));
+    if (paint) {
+        TEXT_WRITE_STR(&piece, BGBK_FGWH);
+    }
+    for (ih = 0; ih < side_blocks; ih++) {
+        text_write_glyph(&piece, rows.glyphs, B_0);
+    }
+    rows.head_size = piece.length;
+
+    /* Right end of data rows: right border blocks and palette reset */
+    text_piece_begin(&piece, rows.tail, sizeof(rows.tail));
+    for (ih = 0; ih < side_blocks; ih++) {
+        text_write_glyph(&piece, rows.glyphs, B_0);
+    }
+    if (border_leftover_h != 0) {
+        /* Avoid coloring rightmost (transparent) quad-module line */
+        if (paint && !invert_colors) {
+            TEXT_WRITE_STR(&piece, BG_DF);
+        }
+        text_write_glyph(&piece, rows.glyphs,
+                         (invert_colors) ? B_0000 : B_1100);
+    }
+    if (paint) {
+        TEXT_WRITE_STR(&piece, BGDF_FGDF);
+    }
+    rows.tail_size = piece.length;
+
+    /* Top and bottom border rows */
+    text_piece_begin(&piece, rows.border, sizeof(rows.border));
+    if (paint) {
+        TEXT_WRITE_STR(&piece, BGBK_FGWH);
+    }
+    for (ih = 0; ih < border_blocks; ih++) {
+        text_write_glyph(&piece, rows.glyphs, B_0);
+    }
+    /* Same right end as data rows, past their border blocks */
+    text_write(&piece, rows.tail + side_size, rows.tail_size - side_size);
+    rows.border_size = piece.length;
+
+    /* Half-block bottom border row, leaving its lower half transparent */
+    text_piece_begin(&piece, rows.edge, sizeof(rows.edge));
+    if (paint) {
+        TEXT_WRITE_STR(&piece, BGBK_FGWH);
+
+        /* Avoid coloring last (transparent) line */
+        if (!invert_colors) {
+            TEXT_WRITE_STR(&piece, BG_DF);
+        }
+    }
+    for (ih = 0; ih < border_blocks; ih++) {
+        text_write_glyph(&piece, rows.glyphs,
+                         (invert_colors) ? B_0 :
+                         (layout == TEXT_LAYOUT_COMPACT) ? B_1010 : B_01);
+    }
+    if (border_leftover_h != 0) {
+        /* Avoid coloring rightmost (transparent) quad-module line */
+        if (paint && !invert_colors) {
+            TEXT_WRITE_STR(&piece, BG_DF);
+        }
+        text_write_glyph(&piece, rows.glyphs,
+                         (invert_colors) ? B_0000 : B_1110);
+    }
+    if (paint) {
+        TEXT_WRITE_STR(&piece, BGDF_FGDF);
+    }
+    rows.edge_size = piece.length;
+
+    module_plane_pack(&plane, code, border_leftover_v, border_leftover_h);
+
+    /* Top border */
+    for (iv = 0; iv < border_width - border_leftover_v; iv += modules_per_block_v) {
+        text_write(writer, rows.border, rows.border_size);
+        text_write_eol(writer);
+    }
+
+    /* Left border, data, right border */
+    for (iv = -border_leftover_v; iv < resolution; iv += modules_per_block_v) {
+        rows.blocks(&plane, iv, rows.cells, indices);
+        text_write_row(writer, &rows, indices);
+        text_write_eol(writer);
+    }
+
+    /* Bottom border */
+    for (iv = (large_size) ? 0 : modules_per_block_v; iv < border_width;
+         iv += modules_per_block_v) {
+        text_write(writer, rows.border, rows.border_size);
+        text_write_eol(writer);
+    }
+
+    /* Trailing half-block row for bottom border */
+    if (!large_size) {
+        text_write(writer, rows.edge, rows.edge_size);
+        text_write_eol(writer);
+    }
+}
+
+/* Byte-minimal ANSI text */
+/*
+    The painted text is re-encoded cell by cell. Every cell is reduced to
+    what it looks like (the color of each of its quadrants), and a shortest
+    path over the terminal color states (foreground by background) picks,
+    for every cell, whether to draw it as a glyph or as its complement with
+    the colors swapped, and a uniform cell as a space on its color or as a
+    full block; SGR sequences are only emitted where the state changes.
+    The background is back to the default at every newline (so that
+    scrolling never paints the rest of a line), and the foreground too at
+    the very end
+*/
+#define ANSI_WHITE   0
+#define ANSI_BLACK   1
+#define ANSI_DEFAULT 2
+#define ANSI_STATES  9 // Foreground * 3 + background
+
+/* Colors of a cell: 2 bits per quadrant, default background being 3 */
+#define ANSI_DEFAULT_BG 3
+
+/* Cell standing for a newline */
+#define ANSI_CELL_EOL 0xFFFF
+
+#define ANSI_SGR_SIZE_MAX 12
+
+/* Quadrant glyphs by foreground mask [ bottom_right | bottom_left |
+   top_right | top_left ] (0 being a space) */
+static const char *ansi_glyphs[16] = {
+    " ", "▘", "▝", "▀", "▖", "▌", "▞", "▛",
+    "▗", "▚", "▐", "▜", "▄", "▙", "▟", "█",
+};
+
+static const char *ansi_fg_params[3] = { "37", "30", "39" };
+static const char *ansi_bg_params[3] = { "47", "40", "49" };
+
+static inline int ansi_bg_color(const int bg)
+{
+    return (bg == ANSI_DEFAULT) ? ANSI_DEFAULT_BG : bg;
+}
+
+/* Shortest SGR sequence going from one state to another */
+static size_t ansi_sgr(const int from, const int to, char *sgr)
+{
+    const int from_fg = from / 3, from_bg = from % 3;
+    const int to_fg = to / 3, to_bg = to % 3;
+    char reset[ANSI_SGR_SIZE_MAX];
+    size_t length, reset_length;
+
+    if (from == to) {
+        return 0;
+    }
+
+    /* Set whatever changed */
+    length = sprintf(sgr, "\x1b[%s%s%sm",
+                     (from_fg != to_fg) ? ansi_fg_params[to_fg] : "",
+                     (from_fg != to_fg && from_bg != to_bg) ? ";" : "",
+                     (from_bg != to_bg) ? ansi_bg_params[to_bg] : "");
+
+    /* Or reset, then set whatever is not the default */
+    reset_length = sprintf(reset, "\x1b[%s%s%s%s%sm",
+                           (to == ANSI_DEFAULT * 3 + ANSI_DEFAULT) ? "" : "0",
+                           (to_fg != ANSI_DEFAULT) ? ";" : "",
+                           (to_fg != ANSI_DEFAULT) ? ansi_fg_params[to_fg] : "",
+                           (to_bg != ANSI_DEFAULT) ? ";" : "",
+                           (to_bg != ANSI_DEFAULT) ? ansi_bg_params[to_bg]
+                                                   : "");
+
+    if (reset_length < length) {
+        memcpy(sgr, reset, reset_length + 1);
+        length = reset_length;
+    }
+
+    return length;
+}
+
+/* Glyph drawing a cell in a state, NULL if the state cannot draw it */
+static const char *ansi_cell_glyph(const unsigned int cell, const int state)
+{
+    const int fg = state / 3;
+    const int bg = ansi_bg_color(state % 3);
+    unsigned int mask = 0;
+    int q;
+
+    for (q = 0; q < 4; q++) {
+        const int color = (cell >> (q * 2)) & 3;
+
+        if (color == fg && color != bg) {
+            mask |= 1 << q;
+        } else if (color != bg) {
+            return NULL;
+        }
+    }
+
+    return ansi_glyphs[mask];
+}
+
+/* Apply one SGR parameter; returns 0 if it is not one the renderer uses */
+static bool ansi_sgr_apply(const int param, int *fg, int *bg)
+{
+    switch (param) {
+        case 0:  *fg = *bg = ANSI_DEFAULT; break;
+        case 30: *fg = ANSI_BLACK; break;
+        case 37: *fg = ANSI_WHITE; break;
+        case 39: *fg = ANSI_DEFAULT; break;
+        case 40: *bg = ANSI_BLACK; break;
+        case 47: *bg = ANSI_WHITE; break;
+        case 49: *bg = ANSI_DEFAULT; break;
+        default: return false;
+    }
+
+    return true;
+}
+
+/* Parse painted text into cells; returns how many (0 on failure) */
+static size_t ansi_parse_cells(const char *text, const size_t size,
+                               unsigned short *cells)
+{
+    int fg = ANSI_DEFAULT, bg = ANSI_DEFAULT;
+    size_t count = 0;
+    size_t i = 0;
+    unsigned int mask, cell;
+    int g, q, param;
+
+    while (i < size) {
+        if (text[i] == '\n') {
+            cells[count++] = ANSI_CELL_EOL;
+            i++;
+            continue;
+        }
+
+        if (text[i] == '\x1b' && i + 1 < size && text[i + 1] == '[') {
+            /* SGR parameters, separated by semicolons */
+            for (i += 2, param = 0; i < size && text[i] != 'm'; i++) {
+                if (text[i] >= '0' && text[i] <= '9') {
+                    param = param * 10 + (text[i] - '0');
+                    continue;
+                }
+
+                if (text[i] != ';') {
+                    return 0;
+                }
+
+                if (!ansi_sgr_apply(param, &fg, &bg)) {
+                    return 0;
+                }
+                param = 0;
+            }
+
+            if (!ansi_sgr_apply(param, &fg, &bg)) {
+                return 0;
+            }
+            i++;
+            continue;
+        }
+
+        for (g = 0; g < 16; g++) {
+            const size_t length = strlen(ansi_glyphs[g]);
+
+            if (i + length <= size &&
+                memcmp(text + i, ansi_glyphs[g], length) == 0) {
+                break;
+            }
+        }
+
+        if (g == 16) {
+            return 0;
+        }
+
+        mask = g;
+        cell = 0;
+        for (q = 0; q < 4; q++) {
+            cell |= (unsigned int)((mask & (1 << q)) ? fg : ansi_bg_color(bg))
+                    << (q * 2);
+        }
+
+        cells[count++] = cell;
+        i += strlen(ansi_glyphs[g]);
+    }
+
+    return count;
+}
+
+static void qr_data_write_minimal(TextWriter *writer, const QRcode *code,
+                                  const char border_width,
+                                  const bool invert_colors,
+                                  const bool large_size,
+                                  const bool compact_mode)
+{
+    TextWriter painted = { .text = NULL, .length = 0, .fd = -1 };
+    Arena *arena = arena_get();
+    const size_t mark = arena_mark(arena);
+    unsigned short *cells = NULL;
+    unsigned char (*from)[ANSI_STATES] = NULL;
+    unsigned char *states = NULL;
+    unsigned char sgr_sizes[ANSI_STATES][ANSI_STATES];
+    char sgr[ANSI_SGR_SIZE_MAX];
+    size_t costs[ANSI_STATES], next[ANSI_STATES];
+    size_t count = 0;
+    size_t i, cost;
+    int s, t, state;
+
+    /* Render the usual painted text first */
+    qr_data_write_text(&painted, code, border_width, invert_colors, true,
+                       large_size, compact_mode);
+
+    painted.text = arena_alloc(arena, painted.length);
+    painted.capacity = painted.length;
+    painted.length = 0;
+
+    if (painted.text != NULL) {
+        qr_data_write_text(&painted, code, border_width, invert_colors, true,
+                           large_size, compact_mode);
+
+        /* Never more cells than bytes */
+        cells = arena_alloc(arena, painted.length * sizeof(cells[0]));
+        from = arena_alloc(arena, painted.length * sizeof(from[0]));
+        states = arena_alloc(arena, painted.length);
+    }
+
+    if (cells != NULL && from != NULL && states != NULL) {
+        count = ansi_parse_cells(painted.text, painted.length, cells);
+    }
+
+    /* Fall back to the usual text if anything went wrong */
+    if (count == 0) {
+        qr_data_write_text(writer, code, border_width, invert_colors, true,
+                           large_size, compact_mode);
+        goto exit;
+    }
+
+    for (s = 0; s < ANSI_STATES; s++) {
+        for (t = 0; t < ANSI_STATES; t++) {
+            sgr_sizes[s][t] = ansi_sgr(s, t, sgr);
+        }
+
+        costs[s] = (size_t)-1;
+    }
+    costs[ANSI_DEFAULT * 3 + ANSI_DEFAULT] = 0;
+
+    for (i = 0; i < count; i++) {
+        for (t = 0; t < ANSI_STATES; t++) {
+            const char *glyph = NULL;
+
+            next[t] = (size_t)-1;
+
+            if (cells[i] == ANSI_CELL_EOL) {
+                /* Default background at newlines, and everything at the end */
+                if (t % 3 != ANSI_DEFAULT ||
+                    (i + 1 == count && t != ANSI_DEFAULT * 3 + ANSI_DEFAULT)) {
+                    continue;
+                }
+                cost = strlen(EOL);
+            } else {
+                glyph = ansi_cell_glyph(cells[i], t);
+                if (glyph == NULL) {
+                    continue;
+                }
+                cost = strlen(glyph);
+            }
+
+            for (s = 0; s < ANSI_STATES; s++) {
+                if (costs[s] != (size_t)-1 &&
+                    costs[s] + sgr_sizes[s][t] + cost < next[t]) {
+                    next[t] = costs[s] + sgr_sizes[s][t] + cost;
+                    from[i][t] = s;
+                }
+            }
+        }
+
+        memcpy(costs, next, sizeof(costs));
+    }
+
+    /* Walk back from the final state, then write it all out */
+    state = ANSI_DEFAULT * 3 + ANSI_DEFAULT;
+    for (i = count; i-- > 0;) {
+        states[i] = state;
+        state = from[i][state];
+    }
+
+    state = ANSI_DEFAULT * 3 + ANSI_DEFAULT;
+    for (i = 0; i < count; i++) {
+        text_write(writer, sgr, ansi_sgr(state, states[i], sgr));
+        state = states[i];
+
+        if (cells[i] == ANSI_CELL_EOL) {
+            text_write_eol(writer);
+        } else {
+            const char *glyph = ansi_cell_glyph(cells[i], state);
+
+            text_write(writer, glyph, strlen(glyph));
+        }
+    }
+
+exit:
+    arena_release(arena, mark);
+}
+
+/* Differential redraw */
+/*
+    Both texts are parsed into cells, and the cells that differ are drawn
+    over the previous text through relative cursor movements, so that the
+    update works wherever on the screen the previous text ended up (the
+    cursor being at the start of the line below it)
+*/
+#define UPDATE_MOVE_SIZE_MAX 24
+
+/* Rows of cells (ends holds the index of the EOL cell ending each row) */
+static size_t update_rows(const unsigned short *cells, const size_t count,
+                          size_t *ends)
+{
+    size_t rows = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (cells[i] == ANSI_CELL_EOL) {
+            ends[rows++] = i;
+        }
+    }
+
+    return rows;
+}
+
+static void update_move(TextWriter *writer, const size_t from_row,
+                        const size_t from_col, const size_t to_row,
+                        const size_t to_col)
+{
+    char move[UPDATE_MOVE_SIZE_MAX];
+
+    if (to_row < from_row) {
+        text_write(writer, move, sprintf(move, "\x1b[%luA",
+                                         (unsigned long)(from_row - to_row)));
+    } else if (to_row > from_row) {
+        text_write(writer, move, sprintf(move, "\x1b[%luB",
+                                         (unsigned long)(to_row - from_row)));
+    }
+
+    if (to_col == 0 && from_col != 0) {
+        TEXT_WRITE_STR(writer, "\r");
+    } else if (to_col > from_col) {
+        text_write(writer, move, sprintf(move, "\x1b[%luC",
+                                         (unsigned long)(to_col - from_col)));
+    } else if (to_col < from_col) {
+        text_write(writer, move, sprintf(move, "\x1b[%luD",
+                                         (unsigned long)(from_col - to_col)));
+    }
+}
+
+/* State drawing a cell for the fewest bytes of SGR from the current one */
+static int update_state(const unsigned int cell, const int state)
+{
+    char sgr[ANSI_SGR_SIZE_MAX];
+    size_t size, best_size = (size_t)-1;
+    int best = state;
+    int t;
+
+    for (t = 0; t < ANSI_STATES; t++) {
+        if (ansi_cell_glyph(cell, t) == NULL) {
+            continue;
+        }
+
+        size = ansi_sgr(state, t, sgr);
+        if (size < best_size) {
+            best_size = size;
+            best = t;
+        }
+    }
+
+    return best;
+}
+
+static void text_write_update(TextWriter *writer, const unsigned short *prev,
+                              const unsigned short *cells, const size_t *ends,
+                              const size_t rows)
+{
+    char sgr[ANSI_SGR_SIZE_MAX];
+    char move[UPDATE_MOVE_SIZE_MAX];
+    size_t row, col, begin, gap, gap_size;
+    size_t cur_row = rows, cur_col = 0;
+    int state = ANSI_DEFAULT * 3 + ANSI_DEFAULT;
+    int next;
+
+    for (row = 0, begin = 0; row < rows; begin = ends[row++] + 1) {
+        for (col = 0; begin + col < ends[row]; col++) {
+            const unsigned int cell = cells[begin + col];
+            const char *glyph;
+
+            if (prev[begin + col] == cell) {
+                continue;
+            }
+
+            /* Redraw a short run of unchanged cells rather than skip it */
+            gap_size = (size_t)-1;
+            if (row == cur_row && col > cur_col) {
+                gap_size = 0;
+
+                for (gap = cur_col; gap < col && gap_size != (size_t)-1;
+                     gap++) {
+                    glyph = ansi_cell_glyph(cells[begin + gap], state);
+                    gap_size = (glyph != NULL) ? gap_size + strlen(glyph)
+                                               : (size_t)-1;
+                }
+            }
+
+            if (gap_size < (size_t)sprintf(move, "\x1b[%luC",
+                                           (unsigned long)(col - cur_col))) {
+                for (gap = cur_col; gap < col; gap++) {
+                    glyph = ansi_cell_glyph(cells[begin + gap], state);
+                    text_write(writer, glyph, strlen(glyph));
+                }
+            } else {
+                update_move(writer, cur_row, cur_col, row, col);
+            }
+
+            next = update_state(cell, state);
+            text_write(writer, sgr, ansi_sgr(state, next, sgr));
+            state = next;
+
+            glyph = ansi_cell_glyph(cell, state);
+            text_write(writer, glyph, strlen(glyph));
+
+            cur_row = row;
+            cur_col = col + 1;
+        }
+    }
+
+    /* Back to the default colors, below the text */
+    text_write(writer, sgr, ansi_sgr(state, ANSI_DEFAULT * 3 + ANSI_DEFAULT,
+                                     sgr));
+    update_move(writer, cur_row, cur_col, rows, 0);
+}
+
+/* Clear the previous text and write the new one all over again */
+static void text_write_redraw(TextWriter *writer, const size_t prev_rows,
+                              const char *text, const size_t size)
+{
+    update_move(writer, prev_rows, 0, 0, 0);
+    TEXT_WRITE_STR(writer, "\x1b[J");
+    text_write(writer, text, size);
+}
+
+size_t qr_render_update_into(const char *previous, const size_t previous_size,
+                             const char *text, const size_t size,
+                             char *buffer, const size_t bufsize)
+{
+    TextWriter writer = { .text = NULL, .length = 0, .fd = -1 };
+    TextWriter redraw = { .text = NULL, .length = 0, .fd = -1 };
+    Arena *arena = arena_get();
+    const size_t mark = arena_mark(arena);
+    unsigned short *prev_cells = arena_alloc(arena, previous_size *
+                                                    sizeof(prev_cells[0]));
+    unsigned short *cells = arena_alloc(arena, size * sizeof(cells[0]));
+    size_t *prev_ends = arena_alloc(arena, previous_size * sizeof(prev_ends[0]));
+    size_t *ends = arena_alloc(arena, size * sizeof(ends[0]));
+    size_t prev_count = 0, count = 0;
+    size_t prev_rows = 0, rows = 0;
+    bool same_shape = false;
+    size_t i;
+
+    if (prev_cells != NULL && cells != NULL && prev_ends != NULL &&
+        ends != NULL) {
+        prev_count = ansi_parse_cells(previous, previous_size, prev_cells);
+        count = ansi_parse_cells(text, size, cells);
+    }
+
+    /* Only cells of texts of the very same shape can be compared */
+    if (prev_count > 0 && prev_count == count) {
+        prev_rows = update_rows(prev_cells, prev_count, prev_ends);
+        rows = update_rows(cells, count, ends);
+
+        same_shape = (prev_rows == rows && rows > 0 &&
+                      ends[rows - 1] + 1 == count);
+        for (i = 0; same_shape && i < rows; i++) {
+            same_shape = (prev_ends[i] == ends[i]);
+        }
+    }
+
+    for (i = 0, prev_rows = 0; i < previous_size; i++) {
+        prev_rows += (previous[i] == '\n');
+    }
+
+    text_write_redraw(&redraw, prev_rows, text, size);
+    if (same_shape) {
+        text_write_update(&writer, prev_cells, cells, ends, rows);
+    }
+
+    /* Whichever is shorter */
+    if (!same_shape || writer.length > redraw.length) {
+        same_shape = false;
+        writer.length = redraw.length;
+    }
+
+    /* Write it out if it fits, only measure it otherwise */
+    writer.text = (writer.length <= bufsize) ? buffer : NULL;
+    writer.capacity = bufsize;
+    writer.length = 0;
+
+    if (same_shape) {
+        text_write_update(&writer, prev_cells, cells, ends, rows);
+    } else {
+        text_write_redraw(&writer, prev_rows, text, size);
+    }
+
+    arena_release(arena, mark);
+
+    return writer.length;
+}
+
+char *qr_render_update(const char *previous, const size_t previous_size,
+                       const char *text, const size_t size,
+                       size_t *update_size)
+{
+    const size_t length = qr_render_update_into(previous, previous_size, text,
+                                                size, NULL, 0);
+    char *update = qr_malloc(length + 1);
+
+    if (update != NULL) {
+        *update_size = qr_render_update_into(previous, previous_size, text,
+                                             size, update, length);
+        update[*update_size] = '\0';
+    }
+
+    return update;
+}
+
+/* Raster images */
+/*
+    Every module row is turned into one scanline, which then gets written
+    out scale times; border modules are light, and invert_colors swaps
+    dark and light
+*/
+static const char *format_names[QR_FORMAT_COUNT] = {
+    "text", "pbm", "pgm", "png", "sixel", "kitty"
+};
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32_table_init(void)
+{
+    uint32_t crc;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        crc = n;
+
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 1) ? UINT32_C(0xEDB88320) ^ (crc >> 1) : crc >> 1;
+        }
+
+        crc32_table[n] = crc;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *bytes,
+                             const size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        crc = crc32_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+static uint32_t adler32_update(const uint32_t adler,
+                               const unsigned char *bytes, const size_t size)
+{
+    /* Sums stay within 32 bits for scanlines of up to a few KiB */
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        a += bytes[i];
+        b += a;
+    }
+
+    return ((b % 65521) << 16) | (a % 65521);
+}
+
+static inline void store_be32(unsigned char *bytes, const uint32_t value)
+{
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+}
+
+/* Pack one scanline, one bit per pixel (most significant first) */
+/*
+    Bits are set for pixels of dark modules if dark_bit is set, otherwise for
+    those of light ones; row is a module row of the code, and anything
+    outside of the code is border
+*/
+static void raster_line_bits(const QRcode *code, const int row,
+                             const int border_width, const int scale,
+                             const bool dark_bit, unsigned char *line)
+{
+    const int resolution = code->width;
+    const int l = resolution + border_width * 2;
+    unsigned int acc = 0;
+    int bits = 0;
+    int col, k;
+
+    for (col = 0; col < l; col++) {
+        const int ih = col - border_width;
+        const bool dark = (row >= 0 && row < resolution && ih >= 0 &&
+                           ih < resolution) &&
+                          (code->data[row * resolution + ih] & B_1);
+        const unsigned int bit = (dark == dark_bit);
+
+        for (k = 0; k < scale; k++) {
+            acc = (acc << 1) | bit;
+
+            if (++bits == 8) {
+                *line++ = acc;
+                acc = 0;
+                bits = 0;
+            }
+        }
+    }
+
+    if (bits > 0) {
+        *line = acc << (8 - bits);
+    }
+}
+
+/* One byte per pixel, 0 for dark and 255 for light */
+static void raster_line_bytes(const QRcode *code, const int row,
+                              const int border_width, const int scale,
+                              const bool invert_colors, unsigned char *line)
+{
+    const int resolution = code->width;
+    const int l = resolution + border_width * 2;
+    int col;
+
+    for (col = 0; col < l; col++) {
+        const int ih = col - border_width;
+        const bool dark = (row >= 0 && row < resolution && ih >= 0 &&
+                           ih < resolution) &&
+                          (code->data[row * resolution + ih] & B_1);
+
+        memset(line + col * scale, (dark != invert_colors) ? 0 : 255, scale);
+    }
+}
+
+static void png_chunk_begin(TextWriter *writer, uint32_t *crc,
+                            const char *type, const size_t size)
+{
+    unsigned char length[4];
+
+    store_be32(length, size);
+    text_write(writer, (const char *)length, 4);
+    text_write(writer, type, 4);
+
+    *crc = crc32_update(UINT32_C(0xFFFFFFFF), (const unsigned char *)type, 4);
+}
+
+static void png_chunk_data(TextWriter *writer, uint32_t *crc,
+                           const unsigned char *bytes, const size_t size)
+{
+    text_write(writer, (const char *)bytes, size);
+
+    /* Checksums are of no use while only measuring */
+    if (writer->text != NULL) {
+        *crc = crc32_update(*crc, bytes, size);
+    }
+}
+
+static void png_chunk_end(TextWriter *writer, const uint32_t crc)
+{
+    unsigned char bytes[4];
+
+    store_be32(bytes, crc ^ UINT32_C(0xFFFFFFFF));
+    text_write(writer, (const char *)bytes, 4);
+}
+
+static void png_chunk(TextWriter *writer, const char *type,
+                      const unsigned char *bytes, const size_t size)
+{
+    uint32_t crc;
+
+    png_chunk_begin(writer, &crc, type, size);
+    png_chunk_data(writer, &crc, bytes, size);
+    png_chunk_end(writer, crc);
+}
+
+/* Compressed data collected before it goes out as an IDAT chunk */
+#define PNG_IDAT_SIZE 8192
+
+/* Deflate */
+/*
+    Scanlines go through a sliding window, where LZ77 takes the longest
+    match among earlier positions starting with the same three bytes,
+    trying the scanline above first (it repeats whenever modules are more
+    than a pixel tall); matches and literals get the fixed Huffman codes,
+    so no code table needs to be sent along
+*/
+#define DEFLATE_WINDOW     32768
+#define DEFLATE_MATCH_MIN  3
+#define DEFLATE_MATCH_MAX  258
+#define DEFLATE_HASH_BITS  12
+#define DEFLATE_CHAIN      32 // Most earlier positions tried per position
+
+static const unsigned short deflate_length_bases[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+    67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const unsigned short deflate_distance_bases[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+    513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+typedef struct {
+    unsigned char *window;     // Recent input, followed by input to encode
+    size_t         capacity;
+    size_t         length;
+    int32_t        start;      // Input offset of window[0]
+    int32_t        pos;        // Input offset of the next byte to encode
+    int32_t       *head;       // Last offset with a hash (-1 for none)
+    int32_t       *prev;       // Offset before it with the same hash
+    unsigned char *out;        // Encoded bytes not taken yet
+    size_t         out_length;
+    uint32_t       bits;       // Bits not making up a byte yet
+    int            bit_count;
+} Deflate;
+
+/*
+    Set up for input handed over at most chunk_max bytes at a time, with
+    up to out_min bytes of output left before each time it is taken
+*/
+static bool deflate_init(Deflate *deflate, Arena *arena,
+                         const size_t chunk_max, const size_t out_min)
+{
+    deflate->capacity = DEFLATE_WINDOW + chunk_max;
+    deflate->window = arena_alloc(arena, deflate->capacity);
+    deflate->head = arena_alloc(arena, sizeof(int32_t) << DEFLATE_HASH_BITS);
+    deflate->prev = arena_alloc(arena, sizeof(int32_t) * DEFLATE_WINDOW);
+    /* No code takes more than 11 bits per byte (31 bits for 3 at worst) */
+    deflate->out = arena_alloc(arena, out_min + chunk_max / 8 * 11 + 64);
+    deflate->length = 0;
+    deflate->start = 0;
+    deflate->pos = 0;
+    deflate->out_length = 0;
+    deflate->bits = 0;
+    deflate->bit_count = 0;
+
+    if (deflate->window == NULL || deflate->head == NULL ||
+        deflate->prev == NULL || deflate->out == NULL) {
+        return false;
+    }
+
+    memset(deflate->head, 0xFF, sizeof(int32_t) << DEFLATE_HASH_BITS);
+
+    return true;
+}
+
+/* Bits go out lowest first */
+static inline void deflate_put(Deflate *deflate, const uint32_t value,
+                               const int count)
+{
+    deflate->bits |= value << deflate->bit_count;
+    deflate->bit_count += count;
+
+    while (deflate->bit_count >= 8) {
+        deflate->out[deflate->out_length++] = deflate->bits & 0xFF;
+        deflate->bits >>= 8;
+        deflate->bit_count -= 8;
+    }
+}
+
+/* Huffman codes go out highest bit first */
+static inline void deflate_put_code(Deflate *deflate, const uint32_t code,
+                                    const int count)
+{
+    uint32_t reversed = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        reversed |= ((code >> i) & 1) << (count - 1 - i);
+    }
+
+    deflate_put(deflate, reversed, count);
+}
+
+/* Fixed code of a literal/length symbol */
+static void deflate_put_symbol(Deflate *deflate, const int symbol)
+{
+    if (symbol < 144) {
+        deflate_put_code(deflate, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        deflate_put_code(deflate, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        deflate_put_code(deflate, symbol - 256, 7);
+    } else {
+        deflate_put_code(deflate, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void deflate_put_match(Deflate *deflate, const int length,
+                              const int distance)
+{
+    int i = 28;
+
+    while (deflate_length_bases[i] > length) {
+        i--;
+    }
+    deflate_put_symbol(deflate, 257 + i);
+    if (i >= 8 && i < 28) {
+        deflate_put(deflate, length - deflate_length_bases[i], (i - 4) / 4);
+    }
+
+    i = 29;
+    while (deflate_distance_bases[i] > distance) {
+        i--;
+    }
+    deflate_put_code(deflate, i, 5);
+    if (i >= 4) {
+        deflate_put(deflate, distance - deflate_distance_bases[i], i / 2 - 1);
+    }
+}
+
+static inline uint32_t deflate_hash(const unsigned char *bytes)
+{
+    const uint32_t value = ((uint32_t)bytes[0] << 16) |
+                           ((uint32_t)bytes[1] << 8) | bytes[2];
+
+    return (value * UINT32_C(2654435761)) >> (32 - DEFLATE_HASH_BITS);
+}
+
+/* Hand over input, after everything handed over before has been encoded */
+static void deflate_input(Deflate *deflate, const unsigned char *bytes,
+                          const size_t size)
+{
+    size_t drop;
+
+    /* Keep only as much of what was encoded as matches may reach back */
+    if (deflate->length + size > deflate->capacity) {
+        drop = deflate->length - DEFLATE_WINDOW;
+        memmove(deflate->window, deflate->window + drop,
+                deflate->length - drop);
+        deflate->length -= drop;
+        deflate->start += drop;
+    }
+
+    memcpy(deflate->window + deflate->length, bytes, size);
+    deflate->length += size;
+}
+
+static void deflate_insert(Deflate *deflate, const int32_t pos)
+{
+    const uint32_t hash = deflate_hash(deflate->window + pos -
+                                       deflate->start);
+
+    deflate->prev[pos % DEFLATE_WINDOW] = deflate->head[hash];
+    deflate->head[hash] = pos;
+}
+
+static int deflate_match_length(const Deflate *deflate, const int32_t pos,
+                                const int32_t candidate, const int max)
+{
+    const unsigned char *a = deflate->window + pos - deflate->start;
+    const unsigned char *b = deflate->window + candidate - deflate->start;
+    int length = 0;
+
+    while (length < max && a[length] == b[length]) {
+        length++;
+    }
+
+    return length;
+}
+
+/* Encode all of the input handed over, first trying matches hint back */
+static void deflate_encode(Deflate *deflate, const int32_t hint)
+{
+    const int32_t end = deflate->start + (int32_t)deflate->length;
+    int32_t pos = deflate->pos;
+    int32_t candidate, previous;
+    int length, best, distance, max, tries;
+
+    while (pos < end) {
+        max = (end - pos < DEFLATE_MATCH_MAX) ? end - pos : DEFLATE_MATCH_MAX;
+        best = 0;
+        distance = 0;
+
+        if (max >= DEFLATE_MATCH_MIN) {
+            if (pos - hint >= deflate->start) {
+                best = deflate_match_length(deflate, pos, pos - hint, max);
+                distance = hint;
+            }
+
+            candidate = deflate->head[deflate_hash(deflate->window + pos -
+                                                   deflate->start)];
+
+            for (tries = DEFLATE_CHAIN;
+                 tries > 0 && best < max && candidate >= deflate->start &&
+                 pos - candidate <= DEFLATE_WINDOW;
+                 tries--) {
+                length = deflate_match_length(deflate, pos, candidate, max);
+                if (length > best) {
+                    best = length;
+                    distance = pos - candidate;
+                }
+
+                /* Entries past the window may have been overwritten */
+                previous = deflate->prev[candidate % DEFLATE_WINDOW];
+                if (previous >= candidate) {
+                    break;
+                }
+                candidate = previous;
+            }
+
+            deflate_insert(deflate, pos);
+        }
+
+        if (best < DEFLATE_MATCH_MIN) {
+            deflate_put_symbol(deflate, deflate->window[pos - deflate->start]);
+            pos++;
+            continue;
+        }
+
+        deflate_put_match(deflate, best, distance);
+
+        for (pos++, best--; best > 0; pos++, best--) {
+            if (end - pos >= DEFLATE_MATCH_MIN) {
+                deflate_insert(deflate, pos);
+            }
+        }
+    }
+
+    deflate->pos = pos;
+}
+
+/* End the block, and fill the last byte up */
+static void deflate_finish(Deflate *deflate)
+{
+    deflate_put_symbol(deflate, 256);
+
+    if (deflate->bit_count > 0) {
+        deflate_put(deflate, 0, 8 - deflate->bit_count);
+    }
+}
+
+/* 1-bit grayscale PNG, deflated one module row at a time */
+static void qr_data_write_png(TextWriter *writer, const QRcode *code,
+                              const int border_width, const bool invert_colors,
+                              const int scale)
+{
+    const int l = code->width + border_width * 2;
+    const size_t line_size = 1 + ((size_t)l * scale + 7) / 8;
+    /* Filter type 0 (none), followed by the packed pixels */
+    unsigned char line[1 + (RASTER_WIDTH_MAX + 7) / 8];
+    unsigned char header[13];
+    Arena *arena = arena_get();
+    const size_t mark = arena_mark(arena);
+    Deflate deflate;
+    uint32_t adler = 1;
+    int iv, k;
+
+    pthread_once(&crc32_table_once, crc32_table_init);
+
+    if (!deflate_init(&deflate, arena, line_size * scale, PNG_IDAT_SIZE)) {
+        writer->failed = true;
+        arena_release(arena, mark);
+        return;
+    }
+
+    TEXT_WRITE_STR(writer, "\x89PNG\r\n\x1A\n");
+
+    /* Bit depth 1, color type 0 (grayscale), no interlace */
+    store_be32(header, l * scale);
+    store_be32(header + 4, l * scale);
+    memcpy(header + 8, "\x01\x00\x00\x00\x00", 5);
+    png_chunk(writer, "IHDR", header, sizeof(header));
+
+    /* zlib header (deflate, 32 KiB window), then one final fixed block */
+    deflate_put(&deflate, 0x78, 8);
+    deflate_put(&deflate, 0x01, 8);
+    deflate_put(&deflate, 1, 1);
+    deflate_put(&deflate, 1, 2);
+
+    line[0] = 0;
+
+    /* The size depends on the pixels, so they are needed to measure too */
+    for (iv = -border_width; iv < code->width + border_width; iv++) {
+        /* Set bits are white */
+        raster_line_bits(code, iv, border_width, scale, invert_colors,
+                         line + 1);
+
+        for (k = 0; k < scale; k++) {
+            deflate_input(&deflate, line, line_size);
+        }
+
+        if (writer->text != NULL) {
+            for (k = 0; k < scale; k++) {
+                adler = adler32_update(adler, line, line_size);
+            }
+        }
+
+        deflate_encode(&deflate, line_size);
+
+        if (deflate.out_length >= PNG_IDAT_SIZE) {
+            png_chunk(writer, "IDAT", deflate.out, deflate.out_length);
+            deflate.out_length = 0;
+        }
+    }
+
+    /* End of the block, then the zlib checksum */
+    deflate_finish(&deflate);
+    for (k = 24; k >= 0; k -= 8) {
+        deflate_put(&deflate, (adler >> k) & 0xFF, 8);
+    }
+    png_chunk(writer, "IDAT", deflate.out, deflate.out_length);
+
+    png_chunk(writer, "IEND", NULL, 0);
+
+    arena_release(arena, mark);
+}
+
+/* Terminal graphics */
+/*
+    Sixel images go in bands of six pixel rows: each band gets filled with
+    the light color, then its dark pixels are drawn over it, one character
+    (of six bits) per column, and runs of the same character are run-length
+    encoded. The kitty graphics protocol takes the PNG image in base64,
+    split into chunks
+*/
+#define SIXEL_BAND        6
+#define SIXEL_DARK        "#0"
+#define SIXEL_LIGHT       "#1"
+#define KITTY_CHUNK_SIZE  4096 // Of base64, at most
+
+static inline bool module_dark(const QRcode *code, const int row,
+                               const int col)
+{
+    return row >= 0 && row < code->width && col >= 0 && col < code->width &&
+           (code->data[row * code->width + col] & B_1);
+}
+
+/* Count times the sixel character c, run-length encoded where shorter */
+static void sixel_write_run(TextWriter *writer, const char c, int count)
+{
+    char run[16];
+
+    if (count > 3) {
+        text_write(writer, run, sprintf(run, "!%d%c", count, c));
+        return;
+    }
+
+    while (count-- > 0) {
+        text_write(writer, &c, 1);
+    }
+}
+
+static void qr_data_write_sixel(TextWriter *writer, const QRcode *code,
+                                const int border_width,
+                                const bool invert_colors, const int scale)
+{
+    const int l = code->width + border_width * 2;
+    const int size = l * scale;
+    char header[48];
+    char c, run_c;
+    int y, col, run, bits, i;
+
+    /* Pixels left alone stay transparent, black is 0 and white is 1 */
+    text_write(writer, header, snprintf(header, sizeof(header),
+                                        "\x1bP0;1;0q\"1;1;%d;%d", size, size));
+    TEXT_WRITE_STR(writer, SIXEL_DARK ";2;0;0;0" SIXEL_LIGHT ";2;100;100;100");
+
+    for (y = 0; y < size; y += SIXEL_BAND) {
+        const int rows = (size - y < SIXEL_BAND) ? size - y : SIXEL_BAND;
+        bool dark = false;
+
+        if (y > 0) {
+            TEXT_WRITE_STR(writer, "-");
+        }
+
+        TEXT_WRITE_STR(writer, SIXEL_LIGHT);
+        sixel_write_run(writer, '?' + (1 << rows) - 1, size);
+
+        /* Dark pixels by module column, trailing blank ones left out */
+        run = 0;
+        run_c = '?';
+
+        for (col = 0; col < l; col++) {
+            bits = 0;
+
+            for (i = 0; i < rows; i++) {
+                if (module_dark(code, (y + i) / scale - border_width,
+                                col - border_width) != invert_colors) {
+                    bits |= 1 << i;
+                }
+            }
+
+            c = '?' + bits;
+
+            if (c != run_c) {
+                if (!dark && c != '?') {
+                    TEXT_WRITE_STR(writer, "$" SIXEL_DARK);
+                    dark = true;
+                }
+
+                sixel_write_run(writer, run_c, run);
+                run = 0;
+                run_c = c;
+            }
+
+            run += scale;
+        }
+
+        if (run_c != '?') {
+            sixel_write_run(writer, run_c, run);
+        }
+    }
+
+    TEXT_WRITE_STR(writer, "\x1b\\");
+}
+
+static const char base64_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Returns the size of the base64 text, written to out (with padding) */
+static size_t base64_encode(const unsigned char *bytes, const size_t size,
+                            char *out)
+{
+    size_t i, length = 0;
+    uint32_t group;
+
+    for (i = 0; i < size; i += 3) {
+        group = (uint32_t)bytes[i] << 16;
+        if (i + 1 < size) {
+            group |= (uint32_t)bytes[i + 1] << 8;
+        }
+        if (i + 2 < size) {
+            group |= bytes[i + 2];
+        }
+
+        out[length++] = base64_digits[(group >> 18) & 63];
+        out[length++] = base64_digits[(group >> 12) & 63];
+        out[length++] = (i + 1 < size) ? base64_digits[(group >> 6) & 63]
+                                       : '=';
+        out[length++] = (i + 2 < size) ? base64_digits[group & 63] : '=';
+    }
+
+    return length;
+}
+
+static void qr_data_write_kitty(TextWriter *writer, const QRcode *code,
+                                const int border_width,
+                                const bool invert_colors, const int scale)
+{
+    TextWriter png = { .text = NULL, .length = 0, .fd = -1 };
+    Arena *arena = arena_get();
+    const size_t mark = arena_mark(arena);
+    char chunk[KITTY_CHUNK_SIZE];
+    size_t offset, size;
+    bool more;
+
+    /* Measure the PNG image, then render it when there is use for it */
+    qr_data_write_png(&png, code, border_width, invert_colors, scale);
+
+    if (writer->text != NULL) {
+        png.text = arena_alloc(arena, png.length);
+        png.capacity = png.length;
+        png.length = 0;
+
+        if (png.text == NULL) {
+            writer->failed = true;
+        } else {
+            qr_data_write_png(&png, code, border_width, invert_colors,
+                              scale);
+        }
+    }
+
+    /* Transmit and display it, quietly (without a response) */
+    for (offset = 0; offset < png.length; offset += size) {
+        size = png.length - offset;
+        if (size > KITTY_CHUNK_SIZE / 4 * 3) {
+            size = KITTY_CHUNK_SIZE / 4 * 3;
+        }
+        more = (offset + size < png.length);
+
+        if (offset == 0) {
+            TEXT_WRITE_STR(writer, "\x1b_Ga=T,f=100,q=2,");
+        } else {
+            TEXT_WRITE_STR(writer, "\x1b_G");
+        }
+
+        if (more) {
+            TEXT_WRITE_STR(writer, "m=1;");
+        } else {
+            TEXT_WRITE_STR(writer, "m=0;");
+        }
+
+        /* Only the size of the text matters while measuring */
+        if (png.text != NULL) {
+            text_write(writer, chunk,
+                       base64_encode((const unsigned char *)png.text + offset,
+                                     size, chunk));
+        } else {
+            text_write(writer, chunk, (size + 2) / 3 * 4);
+        }
+
+        TEXT_WRITE_STR(writer, "\x1b\\");
+    }
+
+    arena_release(arena, mark);
+}
+
+static void qr_data_write_raster(TextWriter *writer, const QRcode *code,
+                                 const QrFormat format, const int border_width,
+                                 const bool invert_colors, const int scale)
+{
+    const int l = code->width + border_width * 2;
+    unsigned char line[RASTER_WIDTH_MAX];
+    char header[32];
+    size_t line_size;
+    int iv, k;
+
+    if (format == QR_FORMAT_PNG) {
+        qr_data_write_png(writer, code, border_width, invert_colors, scale);
+        return;
+    }
+
+    if (format == QR_FORMAT_SIXEL) {
+        qr_data_write_sixel(writer, code, border_width, invert_colors, scale);
+        return;
+    }
+
+    if (format == QR_FORMAT_KITTY) {
+        qr_data_write_kitty(writer, code, border_width, invert_colors, scale);
+        return;
+    }
+
+    /* Netpbm: P4 is one bit per pixel (1 is dark), P5 one byte per pixel */
+    if (format == QR_FORMAT_PBM) {
+        line_size = ((size_t)l * scale + 7) / 8;
+        text_write(writer, header, snprintf(header, sizeof(header),
+                                            "P4" EOL "%d %d" EOL,
+                                            l * scale, l * scale));
+    } else {
+        line_size = (size_t)l * scale;
+        text_write(writer, header, snprintf(header, sizeof(header),
+                                            "P5" EOL "%d %d" EOL "255" EOL,
+                                            l * scale, l * scale));
+    }
+
+    for (iv = -border_width; iv < code->width + border_width; iv++) {
+        /* Rows are only built when there is somewhere to write them */
+        if (writer->text != NULL) {
+            if (format == QR_FORMAT_PBM) {
+                raster_line_bits(code, iv, border_width, scale,
+                                 !invert_colors, line);
+            } else {
+                raster_line_bytes(code, iv, border_width, scale,
+                                  invert_colors, line);
+            }
+        }
+
+        for (k = 0; k < scale; k++) {
+            text_write(writer, (const char *)line, line_size);
+        }
+    }
+}
+
+/* Render in whichever format the options ask for */
+static void qr_data_write(TextWriter *writer, const QrOptions *options,
+                          const QRcode *code)
+{
+    if (options->format == QR_FORMAT_TEXT && options->minimal &&
+        !options->plain) {
+        qr_data_write_minimal(writer, code, options->border, options->invert,
+                              options->large, options->compact);
+    } else if (options->format == QR_FORMAT_TEXT) {
+        qr_data_write_text(writer, code, options->border, options->invert,
+                           !options->plain, options->large, options->compact);
+    } else {
+        qr_data_write_raster(writer, code, options->format, options->border,
+                             options->invert, options->scale);
+    }
+}
+
+char *qr_data_to_text(const QRcode *code, const char border_width,
+                       const bool invert_colors, const bool paint,
+                       const bool large_size, const bool compact_mode)
+{
+    TextWriter writer = { .text = NULL, .length = 0, .fd = -1 };
+    char *text;
+
+    if (code->data == NULL) {
+        return NULL;
+    }
+
+    /* Measure exact output length first, then render into a single buffer */
+    qr_data_write_text(&writer, code, border_width, invert_colors, paint,
+                       large_size, compact_mode);
+
+    text = qr_malloc(writer.length + 1);
+    if (text == NULL) {
+        return NULL;
+    }
+
+    writer.text = text;
+    writer.capacity = writer.length;
+    writer.length = 0;
+
+    qr_data_write_text(&writer, code, border_width, invert_colors, paint,
+                       large_size, compact_mode);
+    text[writer.length] = '\0';
+
+    return text;
+}
+
+size_t qr_render_size(const QrOptions *options, const QRcode *code)
+{
+    TextWriter writer = { .text = NULL, .length = 0, .fd = -1 };
+
+    qr_data_write(&writer, options, code);
+
+    return writer.length;
+}
+
+size_t qr_render(const QrOptions *options, const QRcode *code, char *buffer,
+                 const size_t bufsize)
+{
+    TextWriter writer = {
+        .text = buffer,
+        .length = 0,
+        .capacity = bufsize,
+        .fd = -1,
+    };
+
+    qr_data_write(&writer, options, code);
+
+    return writer.length;
+}
+
+char *qr_render_text(const QrOptions *options, const QRcode *code)
+{
+    size_t size;
+    char *text;
+
+    if (options->format == QR_FORMAT_TEXT && !options->minimal) {
+        return qr_data_to_text(code, options->border, options->invert,
+                               !options->plain, options->large,
+                               options->compact);
+    }
+
+    if (code->data == NULL) {
+        return NULL;
+    }
+
+    size = qr_render_size(options, code);
+
+    text = qr_malloc(size + 1);
+    if (text == NULL) {
+        return NULL;
+    }
+
+    qr_render(options, code, text, size);
+    text[size] = '\0';
+
+    return text;
+}
+
+void qr_stream_init(QrStream *stream, char *buffer, const size_t capacity,
+                    const int fd)
+{
+    stream->buffer = buffer;
+    stream->length = 0;
+    stream->capacity = capacity;
+    stream->fd = fd;
+    stream->failed = false;
+}
+
+/* Borrow the stream's buffer and state for a TextWriter (and give it back) */
+static void text_writer_from_stream(TextWriter *writer, const QrStream *stream)
+{
+    writer->text = stream->buffer;
+    writer->length = stream->length;
+    writer->capacity = stream->capacity;
+    writer->fd = stream->fd;
+    writer->failed = stream->failed;
+}
+
+static int text_writer_to_stream(const TextWriter *writer, QrStream *stream)
+{
+    stream->length = writer->length;
+    stream->failed = writer->failed;
+
+    return !stream->failed;
+}
+
+int qr_stream_write(QrStream *stream, const char *bytes, const size_t size)
+{
+    TextWriter writer;
+
+    text_writer_from_stream(&writer, stream);
+    text_write(&writer, bytes, size);
+
+    return text_writer_to_stream(&writer, stream);
+}
+
+int qr_stream_flush(QrStream *stream)
+{
+    TextWriter writer;
+
+    text_writer_from_stream(&writer, stream);
+    text_writer_flush(&writer);
+
+    return text_writer_to_stream(&writer, stream);
+}
+
+int qr_render_stream(const QrOptions *options, const QRcode *code,
+                     QrStream *stream)
+{
+    TextWriter writer;
+
+    if (code->data == NULL) {
+        return false;
+    }
+
+    /* Render row by row, reusing one fixed-size buffer for the whole code */
+    text_writer_from_stream(&writer, stream);
+    qr_data_write(&writer, options, code);
+
+    return text_writer_to_stream(&writer, stream);
+}
+
+/* Sheets */
+/*
+    A sheet row holds codes side by side, top-aligned and one border width
+    apart, with a border all around them (rows below the first one share
+    the bottom border of the row above). It gets rendered text row by text
+    row across all of the codes at once, every module row of the sheet row
+    being gathered from the codes just once
+*/
+static void sheet_gather_row(QRcode *const *codes, const int count,
+                             const int border_width, const int row,
+                             const int width, unsigned char *modules)
+{
+    const int iv = row - border_width;
+    int x = border_width;
+    int i;
+
+    memset(modules, 0, width);
+
+    for (i = 0; i < count; x += codes[i]->width + border_width, i++) {
+        const unsigned char *data;
+        int ih;
+
+        if (iv < 0 || iv >= codes[i]->width) {
+            continue;
+        }
+
+        data = codes[i]->data + iv * codes[i]->width;
+        for (ih = 0; ih < codes[i]->width; ih++) {
+            modules[x + ih] = data[ih] & B_1;
+        }
+    }
+}
+
+/* Width and height of a sheet row, in modules */
+static void sheet_size(QRcode *const *codes, const int count,
+                       const int border_width, int *width, int *height)
+{
+    int i;
+
+    *width = border_width;
+    *height = 0;
+
+    for (i = 0; i < count; i++) {
+        *width += codes[i]->width + border_width;
+
+        if (codes[i]->width > *height) {
+            *height = codes[i]->width;
+        }
+    }
+
+    *height += border_width * 2;
+}
+
+static void qr_data_write_sheet(TextWriter *writer, const QrOptions *options,
+                                QRcode *const *codes, const int count,
+                                const bool top_border)
+{
+    const TextLayout layout =
+        (options->large) ?
+            (options->compact) ? TEXT_LAYOUT_LARGE_COMPACT : TEXT_LAYOUT_LARGE :
+            (options->compact) ? TEXT_LAYOUT_COMPACT : TEXT_LAYOUT_NORMAL;
+    const int modules_per_block_v = (options->large) ? 1 : 2;
+    const int modules_per_block_h = (layout == TEXT_LAYOUT_COMPACT) ? 2 : 1;
+    const GlyphTable *glyphs = &glyph_tables[layout][options->invert != 0];
+    const bool paint = !options->plain;
+    /*
+        As in a code, a right half past the sheet is left transparent if the
+        border is odd, and light otherwise
+    */
+    const bool transparent_h = (modules_per_block_h == 2 &&
+                                options->border % 2 != 0);
+    Arena *arena = arena_get();
+    const size_t mark = arena_mark(arena);
+    unsigned char *top, *bottom;
+    unsigned char block;
+    bool edge;
+    int width, height;
+    int iv, ih;
+
+    sheet_size(codes, count, options->border, &width, &height);
+
+    /* Room for a module past the right edge, which reads as light */
+    top = arena_alloc(arena, width + 1);
+    bottom = arena_alloc(arena, width + 1);
+    if (top == NULL || bottom == NULL) {
+        writer->failed = true;
+        arena_release(arena, mark);
+        return;
+    }
+
+    top[width] = 0;
+    bottom[width] = 0;
+
+    for (iv = (top_border) ? 0 : options->border; iv < height;
+         iv += modules_per_block_v) {
+        sheet_gather_row(codes, count, options->border, iv, width, top);
+        if (modules_per_block_v == 2 && iv + 1 < height) {
+            sheet_gather_row(codes, count, options->border, iv + 1, width,
+                             bottom);
+        }
+
+        /* Bottom half past the sheet, left transparent as in a code */
+        edge = (modules_per_block_v == 2 && iv + 1 >= height);
+
+        if (paint) {
+            TEXT_WRITE_STR(writer, BGBK_FGWH);
+
+            if (edge && !options->invert) {
+                TEXT_WRITE_STR(writer, BG_DF);
+            }
+        }
+
+        /* Block indices as the module plane kernels lay them out */
+        for (ih = 0; ih < width - transparent_h; ih += modules_per_block_h) {
+            if (edge) {
+                block = (options->invert) ? B_0 :
+                        (layout == TEXT_LAYOUT_COMPACT) ? B_1010 : B_01;
+            } else if (layout == TEXT_LAYOUT_NORMAL) {
+                block = (top[ih] << 1) | bottom[ih];
+            } else if (layout == TEXT_LAYOUT_COMPACT) {
+                block = top[ih] | (bottom[ih] << 1) |
+                        (top[ih + 1] << 2) | (bottom[ih + 1] << 3);
+            } else {
+                block = top[ih];
+            }
+
+            text_write_glyph(writer, glyphs, block);
+        }
+
+        if (transparent_h) {
+            if (paint && !options->invert) {
+                TEXT_WRITE_STR(writer, BG_DF);
+            }
+            text_write_glyph(writer, glyphs, (options->invert) ? B_0000 :
+                                             (edge) ? B_1110 : B_1100);
+        }
+
+        if (paint) {
+            TEXT_WRITE_STR(writer, BGDF_FGDF);
+        }
+
+        text_write_eol(writer);
+    }
+
+    arena_release(arena, mark);
+}
+
+int qr_sheet_width(const QrOptions *options, QRcode *const *codes,
+                   const int count)
+{
+    int width, height;
+
+    sheet_size(codes, count, options->border, &width, &height);
+
+    if (options->large) {
+        return (options->compact) ? width : width * 2;
+    }
+
+    return (options->compact) ? (width + 1) / 2 : width;
+}
+
+size_t qr_render_sheet(const QrOptions *options, QRcode *const *codes,
+                       const int count, const int top_border, char *buffer,
+                       const size_t bufsize)
+{
+    TextWriter writer = {
+        .text = buffer,
+        .length = 0,
+        .capacity = bufsize,
+        .fd = -1,
+    };
+
+    qr_data_write_sheet(&writer, options, codes, count, top_border);
+
+    return writer.length;
+}
+
+QRencodeMode get_qr_encode_mode(const char encode_mode)
+{
+    switch (encode_mode) {
+        case 'n':
+        case 'N':
+            return QR_MODE_NUM;
+
+        case 'a':
+        case 'A':
+            return QR_MODE_AN;
+
+        case '8':
+        /* Optimal segmentation (see qr_encode()) */
+        case 'o':
+        case 'O':
+            return QR_MODE_8;
+
+        case 'k':
+        case 'K':
+            return QR_MODE_KANJI;
+
+        default:
+            return QR_MODE_NUL;
+    }
+}
+
+QRecLevel get_qr_ec_level(const char ec_level)
+{
+    switch (ec_level) {
+        case '1':
+        case 'l':
+        case 'L':
+            return QR_ECLEVEL_L;
+
+        case '2':
+        case 'm':
+        case 'M':
+            return QR_ECLEVEL_M;
+
+        case '3':
+        case 'q':
+        case 'Q':
+            return QR_ECLEVEL_Q;
+
+        case '4':
+        case 'h':
+        case 'H':
+            return QR_ECLEVEL_H;
+
+        default:
+            return -1;
+    }
+}
+
+void qr_options_init(QrOptions *options)
+{
+    options->encode_mode = '8';
+    options->version = 0;
+    options->ec_level = '1';
+    options->large = false;
+    options->compact = false;
+    options->border = 1;
+    options->invert = false;
+    options->plain = false;
+    options->unicode = false;
+    options->format = QR_FORMAT_TEXT;
+    options->scale = 1;
+    options->structured = QR_STRUCTURED_NONE;
+    options->micro = false;
+    options->minimal = false;
+    options->eci = false;
+    options->builtin = false;
+}
+
+int qr_options_set(QrOptions *options, const int flag, const char *value)
+{
+    switch (flag) {
+        case 'm':
+            options->encode_mode = value[0];
+            break;
+
+        case 'v':
+            options->version = atoi(value);
+            break;
+
+        case 'e':
+            options->ec_level = value[0];
+            break;
+
+        case 'l':
+            options->large = true;
+            break;
+
+        case 'c':
+            options->compact = true;
+            break;
+
+        case 'b':
+            options->border = atoi(value);
+            break;
+
+        case 'i':
+            options->invert = true;
+            break;
+
+        case 'p':
+            options->plain = true;
+            break;
+
+        case 'u':
+            options->unicode = true;
+            break;
+
+        case 'o':
+            /* Unknown names are left for qr_options_valid() to reject */
+            for (options->format = 0; options->format < QR_FORMAT_COUNT;
+                 options->format++) {
+                if (strcmp(value, format_names[options->format]) == 0) {
+                    break;
+                }
+            }
+            break;
+
+        case 'x':
+            options->scale = atoi(value);
+            break;
+
+        case 'a':
+            options->structured = QR_STRUCTURED_SEQUENTIAL;
+            break;
+
+        case 'A':
+            options->structured = QR_STRUCTURED_SIDE_BY_SIDE;
+            break;
+
+        case 'M':
+            options->micro = true;
+            break;
+
+        case 'z':
+            options->minimal = true;
+            break;
+
+        case 'E':
+            options->eci = true;
+            break;
+
+        case 'X':
+            options->builtin = true;
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+int qr_options_valid(const QrOptions *options)
+{
+    return !(
+        options->version < 0 || options->version > QRSPEC_VERSION_MAX ||
+        get_qr_ec_level(options->ec_level) < 0 ||
+        get_qr_encode_mode(options->encode_mode) == QR_MODE_NUL ||
+        options->border < 1 || options->border > 4 ||
+        options->format >= QR_FORMAT_COUNT ||
+        (options->structured == QR_STRUCTURED_SIDE_BY_SIDE &&
+         options->format != QR_FORMAT_TEXT) ||
+        /* One PNG file cannot hold several images */
+        (options->structured == QR_STRUCTURED_SEQUENTIAL &&
+         options->format == QR_FORMAT_PNG) ||
+        (options->micro && (options->version > MQRSPEC_VERSION_MAX ||
+                            options->structured != QR_STRUCTURED_NONE ||
+                            options->eci)) ||
+        (options->builtin && (options->micro ||
+                              options->structured != QR_STRUCTURED_NONE)) ||
+        options->scale < 1 || options->scale > RASTER_SCALE_MAX
+    );
+}
+
+const char *qr_format_name(const QrFormat format)
+{
+    return (format < QR_FORMAT_COUNT) ? format_names[format] : NULL;
+}
+
+/* Optimal mode segmentation */
+/*
+    Bytes are classified with a lookup table, then a shortest path over
+    (position, mode) finds the segmentation costing the fewest bits, for
+    the character count field widths of one class of versions; costs are
+    in sixths of a bit, which keeps numeric (10 bits per 3 digits) and
+    alphanumeric (11 bits per 2 characters) runs exact
+*/
+#define SEG_NUM   0
+#define SEG_AN    1
+#define SEG_8     2
+#define SEG_KANJI 3
+#define SEG_MODES 4
+
+/* Predecessor of a (position, mode) state: a switch from another mode */
+#define SEG_SWITCH 0x80
+#define SEG_START  0x40
+
+#define CLASS_AN  2
+#define CLASS_NUM 1
+
+static const unsigned char char_classes[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    2, 0, 0, 0, 2, 2, 0, 0, 0, 0, 2, 2, 0, 2, 2, 2,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 2, 0, 0, 0, 0, 0,
+    0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/* Run of input in one mode (or an ECI header, designator in size) */
+typedef struct {
+    QRencodeMode         mode;
+    size_t               size;
+    const unsigned char *bytes;
+} Segment;
+
+static const QRencodeMode seg_qr_modes[SEG_MODES] = {
+    QR_MODE_NUM, QR_MODE_AN, QR_MODE_8, QR_MODE_KANJI
+};
+
+/* Bytes per character, and cost per character */
+static const int seg_units[SEG_MODES] = { 1, 1, 1, 2 };
+static const int seg_costs[SEG_MODES] = { 20, 33, 48, 78 };
+
+/* Character count field widths for versions 1-9, 10-26 and 27-40 */
+static const int seg_count_bits[3][SEG_MODES] = {
+    { 10,  9,  8,  8 },
+    { 12, 11, 16, 10 },
+    { 14, 13, 16, 12 },
+};
+
+static inline int version_class(const int version)
+{
+    return (version <= 9) ? 0 : (version <= 26) ? 1 : 2;
+}
+
+/* Eight bytes at a time while they are all digits; returns how many are */
+static size_t span_digits(const unsigned char *bytes, const size_t size)
+{
+    size_t i = 0;
+    uint64_t word;
+
+    for (; i + 8 <= size; i += 8) {
+        memcpy(&word, bytes + i, 8);
+        word ^= UINT64_C(0x3030303030303030);
+
+        /* Digits are now 0-9: high nibble clear, and no carry out of 9 + 6 */
+        if ((word & UINT64_C(0xF0F0F0F0F0F0F0F0)) != 0 ||
+            ((word + UINT64_C(0x0606060606060606)) &
+             UINT64_C(0x1010101010101010)) != 0) {
+            break;
+        }
+    }
+
+    while (i < size && (char_classes[bytes[i]] & CLASS_NUM)) {
+        i++;
+    }
+
+    return i;
+}
+
+static bool is_utf8(const unsigned char *bytes, const size_t size)
+{
+    size_t i = 0;
+    size_t k, length;
+
+    while (i < size) {
+        if (bytes[i] < 0x80) {
+            i++;
+            continue;
+        }
+
+        length = (bytes[i] >= 0xF0 && bytes[i] <= 0xF4) ? 4 :
+                 (bytes[i] >= 0xE0) ? 3 :
+                 (bytes[i] >= 0xC2 && bytes[i] <= 0xDF) ? 2 : 0;
+
+        if (length == 0 || bytes[i] > 0xF4 || i + length > size) {
+            return false;
+        }
+
+        for (k = 1; k < length; k++) {
+            if ((bytes[i + k] & 0xC0) != 0x80) {
+                return false;
+            }
+        }
+
+        i += length;
+    }
+
+    return true;
+}
+
+/* Shift JIS double-byte character that Kanji mode can hold */
+static inline bool is_kanji(const unsigned char *bytes)
+{
+    const unsigned int value = (bytes[0] << 8) | bytes[1];
+
+    return (value >= 0x8140 && value <= 0x9FFC) ||
+           (value >= 0xE040 && value <= 0xEBBF);
+}
+
+/*
+    Split bytes into segments (at most one per byte); returns how many it
+    stored, or -1 on failure
+*/
+static int seg_split_optimal(const unsigned char *bytes, const size_t size,
+                             const int version, const bool kanji,
+                             Segment *segments)
+{
+    const int *count_bits = seg_count_bits[version_class(version)];
+    unsigned char (*from)[SEG_MODES] = NULL;
+    long (*costs)[SEG_MODES] = NULL;
+    unsigned char *starts = NULL; // Mode of the segment starting there
+    Arena *arena = arena_get();
+    const size_t mark = arena_mark(arena);
+    size_t i, end;
+    int m, k, mode;
+    int count = 0;
+    long cost;
+
+    /* Runs of digits only need a single numeric segment */
+    if (span_digits(bytes, size) == size) {
+        segments[0].mode = QR_MODE_NUM;
+        segments[0].size = size;
+        segments[0].bytes = bytes;
+        return 1;
+    }
+
+    costs = arena_alloc(arena, (size + 2) * sizeof(costs[0]));
+    from = arena_alloc(arena, (size + 2) * sizeof(from[0]));
+    starts = arena_alloc(arena, size + 1);
+
+    if (costs == NULL || from == NULL || starts == NULL) {
+        goto fail;
+    }
+
+    memset(starts, 0, size + 1);
+
+    for (i = 0; i < size + 2; i++) {
+        for (m = 0; m < SEG_MODES; m++) {
+            costs[i][m] = LONG_MAX;
+        }
+    }
+
+    /* Every segment starts with its mode indicator and character count */
+    for (m = 0; m < SEG_MODES; m++) {
+        costs[0][m] = (4 + count_bits[m]) * 6;
+        from[0][m] = SEG_START;
+    }
+
+    for (i = 0; i <= size; i++) {
+        /* Close the segment of another mode here and open one of mode m */
+        if (i > 0) {
+            long closed[SEG_MODES];
+
+            for (k = 0; k < SEG_MODES; k++) {
+                closed[k] = (costs[i][k] == LONG_MAX) ? LONG_MAX :
+                            (costs[i][k] + 5) / 6 * 6;
+            }
+
+            for (m = 0; m < SEG_MODES; m++) {
+                for (k = 0; k < SEG_MODES; k++) {
+                    if (k == m || closed[k] == LONG_MAX) {
+                        continue;
+                    }
+
+                    cost = closed[k] + (4 + count_bits[m]) * 6;
+
+                    if (cost < costs[i][m]) {
+                        costs[i][m] = cost;
+                        from[i][m] = SEG_SWITCH | k;
+                    }
+                }
+            }
+        }
+
+        if (i == size) {
+            break;
+        }
+
+        /* Extend the open segment by one character */
+        for (m = 0; m < SEG_MODES; m++) {
+            if (costs[i][m] == LONG_MAX) {
+                continue;
+            }
+
+            if ((m == SEG_NUM && !(char_classes[bytes[i]] & CLASS_NUM)) ||
+                (m == SEG_AN && !(char_classes[bytes[i]] & CLASS_AN)) ||
+                (m == SEG_KANJI && (!kanji || i + 1 >= size ||
+                                    !is_kanji(bytes + i)))) {
+                continue;
+            }
+
+            cost = costs[i][m] + seg_costs[m];
+            end = i + seg_units[m];
+
+            if (cost < costs[end][m]) {
+                costs[end][m] = cost;
+                from[end][m] = m;
+            }
+        }
+    }
+
+    mode = SEG_8;
+    for (m = 0; m < SEG_MODES; m++) {
+        if (costs[size][m] < costs[size][mode]) {
+            mode = m;
+        }
+    }
+
+    /* Walk back, marking where each segment starts */
+    i = size;
+    while (i > 0) {
+        if (from[i][mode] & SEG_SWITCH) {
+            k = from[i][mode] & ~SEG_SWITCH;
+            starts[i] = SEG_START | mode;
+            mode = k;
+        } else {
+            i -= seg_units[mode];
+        }
+    }
+    starts[0] = SEG_START | mode;
+
+    /* Store the segments front to back */
+    for (i = 0; i < size; i = end) {
+        mode = starts[i] & ~SEG_START;
+
+        for (end = i + 1; end < size && !(starts[end] & SEG_START); end++);
+
+        segments[count].mode = seg_qr_modes[mode];
+        segments[count].size = end - i;
+        segments[count].bytes = bytes + i;
+        count++;
+    }
+
+    arena_release(arena, mark);
+
+    return count;
+
+fail:
+    arena_release(arena, mark);
+
+    return -1;
+}
+
+/* Format information */
+/*
+    The EC level and mask pattern the encoder picked are written next to the
+    finder pattern as 5 bits protected by a BCH(15,5) code and masked with a
+    fixed pattern; reading them back is the only way to learn the mask
+*/
+#define FORMAT_BCH_POLY  0x537
+#define FORMAT_XOR_QR    0x5412
+#define FORMAT_XOR_MICRO 0x4445
+
+static unsigned int format_bch(const unsigned int data)
+{
+    unsigned int bits = data << 10;
+    int i;
+
+    for (i = 4; i >= 0; i--) {
+        if (bits & (1u << (i + 10))) {
+            bits ^= FORMAT_BCH_POLY << i;
+        }
+    }
+
+    return (data << 10) | bits;
+}
+
+int qr_mask(const QRcode *code)
+{
+    const int width = code->width;
+    const bool micro = (width < 21);
+    unsigned int format = 0;
+    int i;
+
+    if (code->data == NULL) {
+        return -1;
+    }
+
+    if (micro) {
+        /* Along row 8, then up column 8 */
+        for (i = 0; i < 8; i++) {
+            format |= (code->data[width * 8 + 1 + i] & 1u) << i;
+        }
+        for (i = 0; i < 7; i++) {
+            format |= (code->data[width * (7 - i) + 8] & 1u) << (i + 8);
+        }
+
+        format ^= FORMAT_XOR_MICRO;
+    } else {
+        /* Down column 8 (skipping the timing pattern), then left along row 8 */
+        for (i = 0; i < 8; i++) {
+            format |= (code->data[width * ((i < 6) ? i : i + 1) + 8] & 1u) << i;
+        }
+        for (i = 0; i < 7; i++) {
+            format |= (code->data[width * 8 + ((i == 0) ? 7 : 6 - i)] & 1u)
+                      << (i + 8);
+        }
+
+        format ^= FORMAT_XOR_QR;
+    }
+
+    if (format_bch(format >> 10) != format) {
+        return -1;
+    }
+
+    return (format >> 10) & ((micro) ? 3 : 7);
+}
+
+/* Built-in encoder */
+/*
+    Encodes full-size symbols the way libqrencode does (same version
+    picked, same split of strings into segments, same mask chosen by the
+    same penalty rules), so that the symbols come out identical and either
+    can stand in for the other. GF(256) log and antilog tables, generator
+    polynomials and mask patterns are worked out once; codewords are placed
+    straight into the module matrix, and masks get scored over bit-packed
+    rows and columns, 64 modules at a time
+*/
+#define ENC_EC_MAX    30 // Most EC codewords per block
+#define ENC_WORDS     3  // 64-bit words per row (or column) of modules
+#define ENC_MASKS     8
+#define ENC_PERIOD    12 // Rows (and columns) after which mask patterns repeat
+#define ENC_GF_POLY   0x11D
+#define VERSION_BCH_POLY 0x1F25
+
+/* Module flags, as libqrencode sets them */
+#define MODULE_DARK      0x01
+#define MODULE_DATA      0x02
+#define MODULE_FORMAT    0x84
+#define MODULE_VERSION   0x88
+#define MODULE_TIMING    0x90
+#define MODULE_ALIGNMENT 0xA0
+#define MODULE_FINDER    0xC0
+#define MODULE_FUNCTION  0x80
+
+/* Penalty points (N1 plus one per module past 5 in a row) */
+#define PENALTY_N1 3
+#define PENALTY_N2 3
+#define PENALTY_N3 40
+#define PENALTY_N4 10
+
+/* Error correction of every version at every EC level (L, M, Q, H) */
+/*
+    EC codewords per block, blocks in the first group, data codewords of
+    each of them, and blocks in the second group (one data codeword more)
+*/
+static const unsigned char enc_ec_specs[QRSPEC_VERSION_MAX + 1][4][4] = {
+    /*  0 */ { { 0 } },
+    /*  1 */ { {  7,  1,  19,  0 }, { 10,  1,  16,  0 },
+              { 13,  1,  13,  0 }, { 17,  1,   9,  0 } },
+    /*  2 */ { { 10,  1,  34,  0 }, { 16,  1,  28,  0 },
+              { 22,  1,  22,  0 }, { 28,  1,  16,  0 } },
+    /*  3 */ { { 15,  1,  55,  0 }, { 26,  1,  44,  0 },
+              { 18,  2,  17,  0 }, { 22,  2,  13,  0 } },
+    /*  4 */ { { 20,  1,  80,  0 }, { 18,  2,  32,  0 },
+              { 26,  2,  24,  0 }, { 16,  4,   9,  0 } },
+    /*  5 */ { { 26,  1, 108,  0 }, { 24,  2,  43,  0 },
+              { 18,  2,  15,  2 }, { 22,  2,  11,  2 } },
+    /*  6 */ { { 18,  2,  68,  0 }, { 16,  4,  27,  0 },
+              { 24,  4,  19,  0 }, { 28,  4,  15,  0 } },
+    /*  7 */ { { 20,  2,  78,  0 }, { 18,  4,  31,  0 },
+              { 18,  2,  14,  4 }, { 26,  4,  13,  1 } },
+    /*  8 */ { { 24,  2,  97,  0 }, { 22,  2,  38,  2 },
+              { 22,  4,  18,  2 }, { 26,  4,  14,  2 } },
+    /*  9 */ { { 30,  2, 116,  0 }, { 22,  3,  36,  2 },
+              { 20,  4,  16,  4 }, { 24,  4,  12,  4 } },
+    /* 10 */ { { 18,  2,  68,  2 }, { 26,  4,  43,  1 },
+              { 24,  6,  19,  2 }, { 28,  6,  15,  2 } },
+    /* 11 */ { { 20,  4,  81,  0 }, { 30,  1,  50,  4 },
+              { 28,  4,  22,  4 }, { 24,  3,  12,  8 } },
+    /* 12 */ { { 24,  2,  92,  2 }, { 22,  6,  36,  2 },
+              { 26,  4,  20,  6 }, { 28,  7,  14,  4 } },
+    /* 13 */ { { 26,  4, 107,  0 }, { 22,  8,  37,  1 },
+              { 24,  8,  20,  4 }, { 22, 12,  11,  4 } },
+    /* 14 */ { { 30,  3, 115,  1 }, { 24,  4,  40,  5 },
+              { 20, 11,  16,  5 }, { 24, 11,  12,  5 } },
+    /* 15 */ { { 22,  5,  87,  1 }, { 24,  5,  41,  5 },
+              { 30,  5,  24,  7 }, { 24, 11,  12,  7 } },
+    /* 16 */ { { 24,  5,  98,  1 }, { 28,  7,  45,  3 },
+              { 24, 15,  19,  2 }, { 30,  3,  15, 13 } },
+    /* 17 */ { { 28,  1, 107,  5 }, { 28, 10,  46,  1 },
+              { 28,  1,  22, 15 }, { 28,  2,  14, 17 } },
+    /* 18 */ { { 30,  5, 120,  1 }, { 26,  9,  43,  4 },
+              { 28, 17,  22,  1 }, { 28,  2,  14, 19 } },
+    /* 19 */ { { 28,  3, 113,  4 }, { 26,  3,  44, 11 },
+              { 26, 17,  21,  4 }, { 26,  9,  13, 16 } },
+    /* 20 */ { { 28,  3, 107,  5 }, { 26,  3,  41, 13 },
+              { 30, 15,  24,  5 }, { 28, 15,  15, 10 } },
+    /* 21 */ { { 28,  4, 116,  4 }, { 26, 17,  42,  0 },
+              { 28, 17,  22,  6 }, { 30, 19,  16,  6 } },
+    /* 22 */ { { 28,  2, 111,  7 }, { 28, 17,  46,  0 },
+              { 30,  7,  24, 16 }, { 24, 34,  13,  0 } },
+    /* 23 */ { { 30,  4, 121,  5 }, { 28,  4,  47, 14 },
+              { 30, 11,  24, 14 }, { 30, 16,  15, 14 } },
+    /* 24 */ { { 30,  6, 117,  4 }, { 28,  6,  45, 14 },
+              { 30, 11,  24, 16 }, { 30, 30,  16,  2 } },
+    /* 25 */ { { 26,  8, 106,  4 }, { 28,  8,  47, 13 },
+              { 30,  7,  24, 22 }, { 30, 22,  15, 13 } },
+    /* 26 */ { { 28, 10, 114,  2 }, { 28, 19,  46,  4 },
+              { 28, 28,  22,  6 }, { 30, 33,  16,  4 } },
+    /* 27 */ { { 30,  8, 122,  4 }, { 28, 22,  45,  3 },
+              { 30,  8,  23, 26 }, { 30, 12,  15, 28 } },
+    /* 28 */ { { 30,  3, 117, 10 }, { 28,  3,  45, 23 },
+              { 30,  4,  24, 31 }, { 30, 11,  15, 31 } },
+    /* 29 */ { { 30,  7, 116,  7 }, { 28, 21,  45,  7 },
+              { 30,  1,  23, 37 }, { 30, 19,  15, 26 } },
+    /* 30 */ { { 30,  5, 115, 10 }, { 28, 19,  47, 10 },
+              { 30, 15,  24, 25 }, { 30, 23,  15, 25 } },
+    /* 31 */ { { 30, 13, 115,  3 }, { 28,  2,  46, 29 },
+              { 30, 42,  24,  1 }, { 30, 23,  15, 28 } },
+    /* 32 */ { { 30, 17, 115,  0 }, { 28, 10,  46, 23 },
+              { 30, 10,  24, 35 }, { 30, 19,  15, 35 } },
+    /* 33 */ { { 30, 17, 115,  1 }, { 28, 14,  46, 21 },
+              { 30, 29,  24, 19 }, { 30, 11,  15, 46 } },
+    /* 34 */ { { 30, 13, 115,  6 }, { 28, 14,  46, 23 },
+              { 30, 44,  24,  7 }, { 30, 59,  16,  1 } },
+    /* 35 */ { { 30, 12, 121,  7 }, { 28, 12,  47, 26 },
+              { 30, 39,  24, 14 }, { 30, 22,  15, 41 } },
+    /* 36 */ { { 30,  6, 121, 14 }, { 28,  6,  47, 34 },
+              { 30, 46,  24, 10 }, { 30,  2,  15, 64 } },
+    /* 37 */ { { 30, 17, 122,  4 }, { 28, 29,  46, 14 },
+              { 30, 49,  24, 10 }, { 30, 24,  15, 46 } },
+    /* 38 */ { { 30,  4, 122, 18 }, { 28, 13,  46, 32 },
+              { 30, 48,  24, 14 }, { 30, 42,  15, 32 } },
+    /* 39 */ { { 30, 20, 117,  4 }, { 28, 40,  47,  7 },
+              { 30, 43,  24, 22 }, { 30, 10,  15, 67 } },
+    /* 40 */ { { 30, 19, 118,  6 }, { 28, 18,  47, 31 },
+              { 30, 34,  24, 34 }, { 30, 20,  15, 61 } },
+};
+
+/* Centers of alignment patterns along either axis */
+static const unsigned char enc_alignment[QRSPEC_VERSION_MAX + 1][7] = {
+    /*  0 */ {   0 },
+    /*  1 */ {   0 },
+    /*  2 */ {   6,  18 },
+    /*  3 */ {   6,  22 },
+    /*  4 */ {   6,  26 },
+    /*  5 */ {   6,  30 },
+    /*  6 */ {   6,  34 },
+    /*  7 */ {   6,  22,  38 },
+    /*  8 */ {   6,  24,  42 },
+    /*  9 */ {   6,  26,  46 },
+    /* 10 */ {   6,  28,  50 },
+    /* 11 */ {   6,  30,  54 },
+    /* 12 */ {   6,  32,  58 },
+    /* 13 */ {   6,  34,  62 },
+    /* 14 */ {   6,  26,  46,  66 },
+    /* 15 */ {   6,  26,  48,  70 },
+    /* 16 */ {   6,  26,  50,  74 },
+    /* 17 */ {   6,  30,  54,  78 },
+    /* 18 */ {   6,  30,  56,  82 },
+    /* 19 */ {   6,  30,  58,  86 },
+    /* 20 */ {   6,  34,  62,  90 },
+    /* 21 */ {   6,  28,  50,  72,  94 },
+    /* 22 */ {   6,  26,  50,  74,  98 },
+    /* 23 */ {   6,  30,  54,  78, 102 },
+    /* 24 */ {   6,  28,  54,  80, 106 },
+    /* 25 */ {   6,  32,  58,  84, 110 },
+    /* 26 */ {   6,  30,  58,  86, 114 },
+    /* 27 */ {   6,  34,  62,  90, 118 },
+    /* 28 */ {   6,  26,  50,  74,  98, 122 },
+    /* 29 */ {   6,  30,  54,  78, 102, 126 },
+    /* 30 */ {   6,  26,  52,  78, 104, 130 },
+    /* 31 */ {   6,  30,  56,  82, 108, 134 },
+    /* 32 */ {   6,  34,  60,  86, 112, 138 },
+    /* 33 */ {   6,  30,  58,  86, 114, 142 },
+    /* 34 */ {   6,  34,  62,  90, 118, 146 },
+    /* 35 */ {   6,  30,  54,  78, 102, 126, 150 },
+    /* 36 */ {   6,  24,  50,  76, 102, 128, 154 },
+    /* 37 */ {   6,  28,  54,  80, 106, 132, 158 },
+    /* 38 */ {   6,  32,  58,  84, 110, 136, 162 },
+    /* 39 */ {   6,  26,  54,  82, 110, 138, 166 },
+    /* 40 */ {   6,  30,  58,  86, 114, 142, 170 },
+};
+
+static unsigned char gf_exp[512]; // Twice over, to skip reducing sums of logs
+static unsigned char gf_log[256];
+/* Logs of the coefficients of generator polynomials, by degree */
+static unsigned char enc_generators[ENC_EC_MAX + 1][ENC_EC_MAX];
+/* Modules that masks invert, by row (bit x) and by column (bit y) */
+static uint64_t enc_mask_rows[ENC_MASKS][ENC_PERIOD][ENC_WORDS];
+static uint64_t enc_mask_columns[ENC_MASKS][ENC_PERIOD][ENC_WORDS];
+/* Alphanumeric mode values (-1 for the rest) */
+static signed char enc_an_values[256];
+static pthread_once_t enc_tables_once = PTHREAD_ONCE_INIT;
+
+static bool enc_mask_inverts(const int mask, const int x, const int y)
+{
+    switch (mask) {
+        case 0: return ((x + y) & 1) == 0;
+        case 1: return (y & 1) == 0;
+        case 2: return (x % 3) == 0;
+        case 3: return ((x + y) % 3) == 0;
+        case 4: return (((y / 2) + (x / 3)) & 1) == 0;
+        case 5: return (((x * y) & 1) + (x * y) % 3) == 0;
+        case 6: return ((((x * y) & 1) + (x * y) % 3) & 1) == 0;
+        default: return ((((x * y) % 3) + ((x + y) & 1)) & 1) == 0;
+    }
+}
+
+static void enc_tables_init(void)
+{
+    static const char an_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
+    unsigned char poly[ENC_EC_MAX + 1];
+    int i, j, n, m, value = 1;
+
+    for (i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = value;
+        gf_log[value] = i;
+        value <<= 1;
+        if (value & 0x100) {
+            value ^= ENC_GF_POLY;
+        }
+    }
+
+    /* (x - a^0)(x - a^1)...(x - a^(n-1)), highest degree first */
+    for (n = 1; n <= ENC_EC_MAX; n++) {
+        memset(poly, 0, sizeof(poly));
+        poly[0] = 1;
+
+        for (i = 0; i < n; i++) {
+            for (j = i + 1; j > 0; j--) {
+                poly[j] ^= (poly[j - 1] == 0) ? 0 :
+                           gf_exp[gf_log[poly[j - 1]] + i];
+            }
+        }
+
+        for (j = 0; j < n; j++) {
+            enc_generators[n][j] = gf_log[poly[j + 1]];
+        }
+    }
+
+    for (m = 0; m < ENC_MASKS; m++) {
+        for (i = 0; i < ENC_PERIOD; i++) {
+            for (j = 0; j < ENC_WORDS * 64; j++) {
+                if (enc_mask_inverts(m, j, i)) {
+                    enc_mask_rows[m][i][j >> 6] |= UINT64_C(1) << (j & 63);
+                }
+                if (enc_mask_inverts(m, i, j)) {
+                    enc_mask_columns[m][i][j >> 6] |= UINT64_C(1) << (j & 63);
+                }
+            }
+        }
+    }
+
+    memset(enc_an_values, -1, sizeof(enc_an_values));
+    for (i = 0; an_chars[i] != '\0'; i++) {
+        enc_an_values[(unsigned char)an_chars[i]] = i;
+    }
+}
+
+static inline int enc_data_codewords(const int version, const QRecLevel level)
+{
+    const unsigned char *spec = enc_ec_specs[version][level];
+
+    return spec[1] * spec[2] + spec[3] * (spec[2] + 1);
+}
+
+/* Smallest version holding that many data codewords (or the largest) */
+static int enc_min_version(const int codewords, const QRecLevel level)
+{
+    int version;
+
+    for (version = 1; version < QRSPEC_VERSION_MAX; version++) {
+        if (enc_data_codewords(version, level) >= codewords) {
+            break;
+        }
+    }
+
+    return version;
+}
+
+/* Bits of size characters in a mode, without the header */
+static int enc_data_bits(const QRencodeMode mode, const int size)
+{
+    switch (mode) {
+        case QR_MODE_NUM:
+            return size / 3 * 10 + ((size % 3 == 1) ? 4 :
+                                    (size % 3 == 2) ? 7 : 0);
+
+        case QR_MODE_AN:
+            return size / 2 * 11 + ((size & 1) ? 6 : 0);
+
+        case QR_MODE_KANJI:
+            return size / 2 * 13;
+
+        default:
+            return size * 8;
+    }
+}
+
+static inline int enc_count_bits(const QRencodeMode mode, const int version)
+{
+    return seg_count_bits[version_class(version)]
+                         [(mode == QR_MODE_NUM) ? SEG_NUM :
+                          (mode == QR_MODE_AN) ? SEG_AN :
+                          (mode == QR_MODE_KANJI) ? SEG_KANJI : SEG_8];
+}
+
+/* Bytes of a segment its character count field can hold */
+static inline size_t enc_segment_max(const QRencodeMode mode,
+                                     const int version)
+{
+    const size_t max = ((size_t)1 << enc_count_bits(mode, version)) - 1;
+
+    return (mode == QR_MODE_KANJI) ? max * 2 : max;
+}
+
+static inline int enc_eci_bits(const size_t designator)
+{
+    return 4 + ((designator < 128) ? 8 : (designator < 16384) ? 16 : 24);
+}
+
+/*
+    Bits of the segments with the count fields of version; segments too
+    long for them get split up, which libqrencode's estimate (used to pick
+    the first version to try) reckons slightly differently
+*/
+static long enc_stream_bits(const Segment *segments, const int count,
+                            const int version, const bool estimate)
+{
+    long bits = 0;
+    size_t max, pieces;
+    int i, l;
+
+    for (i = 0; i < count; i++) {
+        const Segment *segment = &segments[i];
+
+        if (segment->mode == QR_MODE_ECI) {
+            /* The estimate counts the designator's 4 bytes as characters */
+            bits += enc_eci_bits(segment->size) + ((estimate) ? 4 * 4 : 0);
+            continue;
+        }
+
+        l = enc_count_bits(segment->mode, (version > 0) ? version : 1);
+
+        if (estimate) {
+            max = (size_t)1 << l;
+            max *= (segment->mode == QR_MODE_KANJI) ? 2 : 1;
+            pieces = (segment->size + max - 1) / max;
+            bits += enc_data_bits(segment->mode, segment->size) +
+                    pieces * (4 + l);
+            continue;
+        }
+
+        /* Full pieces, then whatever is left */
+        max = enc_segment_max(segment->mode, version);
+        pieces = segment->size / max;
+        bits += pieces * (4 + l + enc_data_bits(segment->mode, max));
+        if (segment->size % max != 0) {
+            bits += 4 + l + enc_data_bits(segment->mode, segment->size % max);
+        }
+    }
+
+    return bits;
+}
+
+/* Bit writer over zeroed bytes */
+typedef struct {
+    unsigned char *bytes;
+    size_t         bits;
+} EncBits;
+
+static void enc_put(EncBits *stream, const unsigned int value, int count)
+{
+    while (count-- > 0) {
+        if ((value >> count) & 1) {
+            stream->bytes[stream->bits >> 3] |= 0x80 >> (stream->bits & 7);
+        }
+        stream->bits++;
+    }
+}
+
+static void enc_put_segment(EncBits *stream, const QRencodeMode mode,
+                            const unsigned char *bytes, const size_t size,
+                            const int version)
+{
+    static const unsigned char indicators[] = {
+        [QR_MODE_NUM] = 1, [QR_MODE_AN] = 2, [QR_MODE_8] = 4,
+        [QR_MODE_KANJI] = 8
+    };
+    unsigned int value;
+    size_t i;
+
+    enc_put(stream, indicators[mode], 4);
+    enc_put(stream, (mode == QR_MODE_KANJI) ? size / 2 : size,
+            enc_count_bits(mode, version));
+
+    switch (mode) {
+        case QR_MODE_NUM:
+            for (i = 0; i + 3 <= size; i += 3) {
+                enc_put(stream, (bytes[i] - '0') * 100 +
+                                (bytes[i + 1] - '0') * 10 +
+                                (bytes[i + 2] - '0'), 10);
+            }
+            if (size - i == 2) {
+                enc_put(stream, (bytes[i] - '0') * 10 + (bytes[i + 1] - '0'),
+                        7);
+            } else if (size - i == 1) {
+                enc_put(stream, bytes[i] - '0', 4);
+            }
+            break;
+
+        case QR_MODE_AN:
+            for (i = 0; i + 2 <= size; i += 2) {
+                enc_put(stream, enc_an_values[bytes[i]] * 45 +
+                                enc_an_values[bytes[i + 1]], 11);
+            }
+            if (i < size) {
+                enc_put(stream, enc_an_values[bytes[i]], 6);
+            }
+            break;
+
+        case QR_MODE_KANJI:
+            for (i = 0; i + 2 <= size; i += 2) {
+                value = (bytes[i] << 8) | bytes[i + 1];
+                value -= (value <= 0x9FFC) ? 0x8140 : 0xC140;
+                enc_put(stream, (value >> 8) * 0xC0 + (value & 0xFF), 13);
+            }
+            break;
+
+        default:
+            for (i = 0; i < size; i++) {
+                enc_put(stream, bytes[i], 8);
+            }
+            break;
+    }
+}
+
+/* Data codewords: the segments, terminator and padding */
+static void enc_put_data(unsigned char *codewords, const int size,
+                         const Segment *segments, const int count,
+                         const int version)
+{
+    EncBits stream = { codewords, 0 };
+    size_t max, offset, length;
+    int i;
+
+    memset(codewords, 0, size);
+
+    for (i = 0; i < count; i++) {
+        const Segment *segment = &segments[i];
+
+        if (segment->mode == QR_MODE_ECI) {
+            enc_put(&stream, 7, 4);
+            if (segment->size < 128) {
+                enc_put(&stream, segment->size, 8);
+            } else if (segment->size < 16384) {
+                enc_put(&stream, 0x8000 | segment->size, 16);
+            } else {
+                enc_put(&stream, 0xC00000 | segment->size, 24);
+            }
+            continue;
+        }
+
+        max = enc_segment_max(segment->mode, version);
+        for (offset = 0; offset < segment->size; offset += length) {
+            length = (segment->size - offset < max) ? segment->size - offset
+                                                    : max;
+            enc_put_segment(&stream, segment->mode, segment->bytes + offset,
+                            length, version);
+        }
+    }
+
+    /* The terminator and the rest of the last byte are zeros already */
+    stream.bits = (stream.bits + 4 + 7) / 8 * 8;
+
+    for (i = 0; stream.bits / 8 + i < (size_t)size; i++) {
+        codewords[stream.bits / 8 + i] = (i & 1) ? 0x11 : 0xEC;
+    }
+}
+
+/* EC codewords of one block (remainder of the division by the generator) */
+static void enc_ec_block(const unsigned char *data, const int size,
+                         unsigned char *ec, const int ec_size)
+{
+    const unsigned char *generator = enc_generators[ec_size];
+    unsigned char feedback;
+    int i, j;
+
+    memset(ec, 0, ec_size);
+
+    for (i = 0; i < size; i++) {
+        feedback = data[i] ^ ec[0];
+
+        memmove(ec, ec + 1, ec_size - 1);
+        ec[ec_size - 1] = 0;
+
+        if (feedback != 0) {
+            for (j = 0; j < ec_size; j++) {
+                ec[j] ^= gf_exp[gf_log[feedback] + generator[j]];
+            }
+        }
+    }
+}
+
+/* Finder, separator, timing and alignment patterns and reserved areas */
+static void enc_put_function_patterns(unsigned char *frame, const int version)
+{
+    const int width = 17 + 4 * version;
+    const unsigned char *centers = enc_alignment[version];
+    unsigned int info;
+    int i, j, x, y, dx, dy, k;
+
+    memset(frame, 0, (size_t)width * width);
+
+    /* Finder patterns with their separators */
+    for (k = 0; k < 3; k++) {
+        const int fx = (k == 1) ? width - 7 : 0;
+        const int fy = (k == 2) ? width - 7 : 0;
+
+        for (dy = -1; dy <= 7; dy++) {
+            for (dx = -1; dx <= 7; dx++) {
+                x = fx + dx;
+                y = fy + dy;
+                if (x < 0 || y < 0 || x >= width || y >= width) {
+                    continue;
+                }
+
+                i = (dx > dy) ? dx : dy;
+                j = (dx < dy) ? dx : dy;
+                frame[y * width + x] = MODULE_FINDER |
+                    (j >= 0 && i <= 6 && (j == 0 || i == 6 ||
+                                          (j >= 2 && i <= 4)));
+            }
+        }
+    }
+
+    /* Format information, filled in along with the mask */
+    for (i = 0; i < 9; i++) {
+        frame[8 * width + i] = MODULE_FORMAT;
+        frame[i * width + 8] = MODULE_FORMAT;
+    }
+    for (i = 0; i < 8; i++) {
+        frame[8 * width + width - 8 + i] = MODULE_FORMAT;
+        frame[(width - 8 + i) * width + 8] = MODULE_FORMAT;
+    }
+
+    for (i = 8; i < width - 8; i++) {
+        frame[6 * width + i] = MODULE_TIMING | ((i & 1) == 0);
+        frame[i * width + 6] = MODULE_TIMING | ((i & 1) == 0);
+    }
+
+    /* Alignment patterns, but where finder patterns are */
+    for (i = 0; i < 7 && centers[i] != 0; i++) {
+        for (j = 0; j < 7 && centers[j] != 0; j++) {
+            x = centers[j];
+            y = centers[i];
+            if ((x < 9 && y < 9) || (x < 9 && y > width - 10) ||
+                (x > width - 10 && y < 9)) {
+                continue;
+            }
+
+            for (dy = -2; dy <= 2; dy++) {
+                for (dx = -2; dx <= 2; dx++) {
+                    k = (abs(dx) > abs(dy)) ? abs(dx) : abs(dy);
+                    frame[(y + dy) * width + x + dx] = MODULE_ALIGNMENT |
+                                                       (k != 1);
+                }
+            }
+        }
+    }
+
+    /* Version information, 6 bits protected by a BCH(18,6) code */
+    if (version >= 7) {
+        info = version << 12;
+        for (i = 5; i >= 0; i--) {
+            if (info & (1u << (i + 12))) {
+                info ^= VERSION_BCH_POLY << i;
+            }
+        }
+        info |= version << 12;
+
+        for (k = 0; k < 18; k++) {
+            frame[(width - 11 + k % 3) * width + k / 3] =
+            frame[(k / 3) * width + width - 11 + k % 3] =
+                MODULE_VERSION | ((info >> k) & 1);
+        }
+    }
+
+    frame[(width - 8) * width + 8] = MODULE_FUNCTION | MODULE_DARK;
+}
+
+/* Place codewords (then remainder bits) upwards and downwards in pairs of columns */
+static void enc_put_codewords(unsigned char *frame, const int width,
+                              const unsigned char *codewords,
+                              const int count)
+{
+    const long bits = (long)count * 8;
+    long bit = 0;
+    int x, y, i, column;
+    bool upwards = true;
+
+    for (column = width - 1; column > 0; column -= 2) {
+        /* The vertical timing pattern takes a column of its own */
+        if (column == 6) {
+            column--;
+        }
+
+        for (i = 0; i < width; i++) {
+            y = (upwards) ? width - 1 - i : i;
+
+            for (x = column; x > column - 2; x--) {
+                unsigned char *module = &frame[y * width + x];
+
+                if (*module & MODULE_FUNCTION) {
+                    continue;
+                }
+
+                *module = MODULE_DATA;
+                if (bit < bits) {
+                    *module |= (codewords[bit >> 3] >> (7 - (bit & 7))) & 1;
+                }
+                bit++;
+            }
+        }
+
+        upwards = !upwards;
+    }
+}
+
+/* Format information of mask and level, 5 bits protected by BCH(15,5) */
+static inline unsigned int enc_format(const int mask, const QRecLevel level)
+{
+    /* L, M, Q and H are 01, 00, 11 and 10 */
+    static const unsigned int level_bits[] = { 1, 0, 3, 2 };
+
+    return format_bch((level_bits[level] << 3) | mask) ^ FORMAT_XOR_QR;
+}
+
+/* Both copies of bit i of the format information */
+static void enc_format_modules(const int width, const int i, int *x, int *y)
+{
+    if (i < 8) {
+        x[0] = width - 1 - i;
+        y[0] = 8;
+        x[1] = 8;
+        y[1] = (i < 6) ? i : i + 1;
+    } else {
+        x[0] = 8;
+        y[0] = width - 15 + i;
+        x[1] = (i == 8) ? 7 : 14 - i;
+        y[1] = 8;
+    }
+}
+
+/* Bit-packed lines of modules (rows, or columns), 64 to a word */
+typedef uint64_t EncLine[ENC_WORDS];
+
+static inline int popcount64(uint64_t v)
+{
+    v -= (v >> 1) & UINT64_C(0x5555555555555555);
+    v = (v & UINT64_C(0x3333333333333333)) +
+        ((v >> 2) & UINT64_C(0x3333333333333333));
+    v = (v + (v >> 4)) & UINT64_C(0x0F0F0F0F0F0F0F0F);
+
+    return (int)((v * UINT64_C(0x0101010101010101)) >> 56);
+}
+
+/* Index of the lowest set bit of a nonzero word (de Bruijn sequence) */
+static inline int ctz64(const uint64_t v)
+{
+    static const unsigned char positions[64] = {
+         0,  1,  2, 53,  3,  7, 54, 27,  4, 38, 41,  8, 34, 55, 48, 28,
+        62,  5, 39, 46, 44, 42, 22,  9, 24, 35, 59, 56, 49, 18, 29, 11,
+        63, 52,  6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+        51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12
+    };
+
+    return positions[((v & -v) * UINT64_C(0x022FDD63CC95386D)) >> 58];
+}
+
+/*
+    Bit x of out is module x + shift of line (a negative shift looks back),
+    fill standing in for modules past either end
+*/
+static inline void enc_shift(const uint64_t *line, const int words,
+                             const int shift, const uint64_t fill,
+                             uint64_t *out)
+{
+    uint64_t low, high;
+    int k, j, s;
+
+    for (k = 0; k < words; k++) {
+        j = (k * 64 + shift >= 0) ? (k * 64 + shift) / 64
+                                  : -((63 - k * 64 - shift) / 64);
+        s = k * 64 + shift - j * 64;
+        low = (j >= 0 && j < words) ? line[j] : fill;
+        high = (j + 1 >= 0 && j + 1 < words) ? line[j + 1] : fill;
+        out[k] = (s == 0) ? low : (low >> s) | (high << (64 - s));
+    }
+}
+
+/* And (or or) line with line shifted */
+static inline void enc_and_shifted(uint64_t *out, const uint64_t *line,
+                                   const int words, const int shift,
+                                   const uint64_t fill)
+{
+    uint64_t shifted[ENC_WORDS];
+    int k;
+
+    enc_shift(line, words, shift, fill, shifted);
+    for (k = 0; k < words; k++) {
+        out[k] &= shifted[k];
+    }
+}
+
+static inline int enc_popcount(const uint64_t *line, const int words)
+{
+    int count = 0;
+    int k;
+
+    for (k = 0; k < words; k++) {
+        count += popcount64(line[k]);
+    }
+
+    return count;
+}
+
+/* Whether modules from up to to are all dark (or all light, past the ends too) */
+static bool enc_modules_are(const uint64_t *line, const int width,
+                            const int from, const int to, const bool dark)
+{
+    int x;
+
+    if (dark && (from < 0 || to > width)) {
+        return false;
+    }
+
+    for (x = (from > 0) ? from : 0; x < to && x < width; x++) {
+        if ((bool)((line[x >> 6] >> (x & 63)) & 1) != dark) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+    Runs of 5 or more of a color (N1 points, and one per module past 5),
+    and dark runs 1:1:3:1:1 with light runs between them and 4 times the
+    unit of light on either side (N3 points) along a line; like libqrencode
+    does, past the ends counts as light, and so does anything before the
+    first dark run
+*/
+static int enc_penalty_line(const uint64_t *dark, const int width,
+                            const int words)
+{
+    uint64_t light[ENC_WORDS], dark3[ENC_WORDS], runs[ENC_WORDS];
+    uint64_t light4[ENC_WORDS], pattern[ENC_WORDS], side[ENC_WORDS];
+    uint64_t word;
+    int penalty = 0;
+    int k, x, start, length, unit;
+
+    for (k = 0; k < words; k++) {
+        light[k] = ~dark[k];
+        dark3[k] = dark[k];
+        light4[k] = light[k];
+    }
+
+    /* Dark and light windows of 3 and 4 modules, then of 5 */
+    enc_and_shifted(dark3, dark, words, 1, 0);
+    enc_and_shifted(dark3, dark, words, 2, 0);
+    enc_and_shifted(light4, light, words, 1, ~UINT64_C(0));
+    enc_and_shifted(light4, light, words, 2, ~UINT64_C(0));
+    enc_and_shifted(light4, light, words, 3, ~UINT64_C(0));
+
+    for (k = 0; k < words; k++) {
+        runs[k] = dark3[k];
+    }
+    enc_and_shifted(runs, dark, words, 3, 0);
+    enc_and_shifted(runs, dark, words, 4, 0);
+    penalty += enc_popcount(runs, words);
+    for (k = 0; k < words; k++) {
+        pattern[k] = runs[k];
+    }
+    enc_shift(pattern, words, -1, 0, side);
+    for (k = 0; k < words; k++) {
+        pattern[k] &= ~side[k];
+    }
+    penalty += enc_popcount(pattern, words) * (PENALTY_N1 - 1);
+
+    /* Windows of 5 light modules must end within the line */
+    for (k = 0; k < words; k++) {
+        x = width - 4 - k * 64;
+        runs[k] = light4[k] & ((x >= 64) ? ~UINT64_C(0) :
+                               (x > 0) ? ~(~UINT64_C(0) << x) : 0);
+    }
+    enc_and_shifted(runs, light, words, 4, ~UINT64_C(0));
+    penalty += enc_popcount(runs, words);
+    for (k = 0; k < words; k++) {
+        pattern[k] = runs[k];
+    }
+    enc_shift(pattern, words, -1, 0, side);
+    for (k = 0; k < words; k++) {
+        pattern[k] &= ~side[k];
+    }
+    penalty += enc_popcount(pattern, words) * (PENALTY_N1 - 1);
+
+    /* 1:1:3:1:1 dark and light: 1011101 with light on both ends */
+    for (k = 0; k < words; k++) {
+        pattern[k] = dark[k];
+    }
+    enc_and_shifted(pattern, light, words, 1, ~UINT64_C(0));
+    enc_and_shifted(pattern, dark3, words, 2, 0);
+    enc_and_shifted(pattern, light, words, 5, ~UINT64_C(0));
+    enc_and_shifted(pattern, dark, words, 6, 0);
+    enc_and_shifted(pattern, light, words, -1, ~UINT64_C(0));
+    enc_and_shifted(pattern, light, words, 7, ~UINT64_C(0));
+
+    /* Light on the 4 modules before the pattern, or on the 4 after it */
+    for (k = 0; k < words; k++) {
+        side[k] = ~UINT64_C(0);
+    }
+    for (x = 1; x <= 4; x++) {
+        enc_and_shifted(side, light, words, -x, ~UINT64_C(0));
+    }
+    enc_shift(light4, words, 7, ~UINT64_C(0), runs);
+    for (k = 0; k < words; k++) {
+        pattern[k] &= side[k] | runs[k];
+    }
+    penalty += enc_popcount(pattern, words) * PENALTY_N3;
+
+    /* Larger units: dark runs of 6 or more (few), checked one by one */
+    for (k = 0; k < words; k++) {
+        runs[k] = dark3[k];
+    }
+    enc_and_shifted(runs, dark3, words, 3, 0);
+    enc_shift(runs, words, -1, 0, side);
+
+    for (k = 0; k < words; k++) {
+        for (word = runs[k] & ~side[k]; word != 0; word &= word - 1) {
+            start = k * 64 + ctz64(word);
+
+            for (length = 6; start + length < width &&
+                             ((dark[(start + length) >> 6] >>
+                               ((start + length) & 63)) & 1);
+                 length++);
+
+            if (length % 3 != 0) {
+                continue;
+            }
+
+            unit = length / 3;
+            x = start - 2 * unit;
+
+            if (enc_modules_are(dark, width, x - 1, x, false) &&
+                enc_modules_are(dark, width, x, x + unit, true) &&
+                enc_modules_are(dark, width, x + unit, x + 2 * unit, false) &&
+                enc_modules_are(dark, width, x + 5 * unit, x + 6 * unit,
+                                false) &&
+                enc_modules_are(dark, width, x + 6 * unit, x + 7 * unit,
+                                true) &&
+                enc_modules_are(dark, width, x + 7 * unit, x + 7 * unit + 1,
+                                false) &&
+                (enc_modules_are(dark, width, x - 4 * unit, x, false) ||
+                 enc_modules_are(dark, width, x + 7 * unit, x + 11 * unit,
+                                 false))) {
+                penalty += PENALTY_N3;
+            }
+        }
+    }
+
+    return penalty;
+}
+
+/* 2x2 blocks of one color, 64 pairs of rows at a time */
+static int enc_penalty_blocks(EncLine *rows, const int width, const int words)
+{
+    uint64_t both, either, blocks;
+    uint64_t last_both, last_either;
+    int penalty = 0;
+    int x, y, k;
+
+    for (y = 1; y < width; y++) {
+        last_both = 0;
+        last_either = 0;
+
+        for (k = 0; k < words; k++) {
+            both = rows[y - 1][k] & rows[y][k];
+            either = rows[y - 1][k] | rows[y][k];
+
+            /* Module x along with module x - 1 */
+            blocks = (both & ((both << 1) | (last_both >> 63))) |
+                     ~(either | (either << 1) | (last_either >> 63));
+
+            /* Only blocks ending within the symbol, past its first column */
+            x = width - k * 64;
+            if (x < 64) {
+                blocks &= ~(~UINT64_C(0) << x);
+            }
+            if (k == 0) {
+                blocks &= ~UINT64_C(1);
+            }
+
+            penalty += popcount64(blocks) * PENALTY_N2;
+            last_both = both;
+            last_either = either;
+        }
+    }
+
+    return penalty;
+}
+
+/*
+    Pick the mask with the fewest penalty points (the first one of them),
+    scoring the symbol with its format information like libqrencode does
+*/
+static int enc_choose_mask(const unsigned char *frame, const int width,
+                           const QRecLevel level, Arena *arena)
+{
+    const int words = (width + 63) / 64;
+    /* Modules and function patterns as rows and columns, then masked */
+    EncLine *lines = arena_alloc(arena, 6 * width * sizeof(EncLine));
+    EncLine *rows = lines, *columns = lines + width;
+    EncLine *fixed_rows = lines + 2 * width, *fixed_columns = lines + 3 * width;
+    EncLine *masked_rows = lines + 4 * width;
+    EncLine *masked_columns = lines + 5 * width;
+    int best = 0, best_penalty = INT_MAX;
+    int x[2], y[2], i, j, k, m, dark, ratio, penalty;
+    unsigned int format;
+
+    if (lines == NULL) {
+        return -1;
+    }
+
+    memset(lines, 0, 6 * width * sizeof(EncLine));
+    for (i = 0; i < width; i++) {
+        for (j = 0; j < width; j++) {
+            const unsigned char module = frame[i * width + j];
+
+            if (module & MODULE_DARK) {
+                rows[i][j >> 6] |= UINT64_C(1) << (j & 63);
+                columns[j][i >> 6] |= UINT64_C(1) << (i & 63);
+            }
+            if (module & MODULE_FUNCTION) {
+                fixed_rows[i][j >> 6] |= UINT64_C(1) << (j & 63);
+                fixed_columns[j][i >> 6] |= UINT64_C(1) << (i & 63);
+            }
+        }
+
+        /* Masks leave alone what is past the edge, as if it were fixed */
+        k = width & 63;
+        if (k != 0) {
+            fixed_rows[i][words - 1] |= ~UINT64_C(0) << k;
+            fixed_columns[i][words - 1] |= ~UINT64_C(0) << k;
+        }
+    }
+
+    for (m = 0; m < ENC_MASKS; m++) {
+        for (i = 0; i < width; i++) {
+            for (k = 0; k < words; k++) {
+                masked_rows[i][k] = rows[i][k] ^
+                    (enc_mask_rows[m][i % ENC_PERIOD][k] & ~fixed_rows[i][k]);
+                masked_columns[i][k] = columns[i][k] ^
+                    (enc_mask_columns[m][i % ENC_PERIOD][k] &
+                     ~fixed_columns[i][k]);
+            }
+        }
+
+        format = enc_format(m, level);
+        for (i = 0; i < 15; i++) {
+            if ((format >> i) & 1) {
+                enc_format_modules(width, i, x, y);
+
+                for (j = 0; j < 2; j++) {
+                    masked_rows[y[j]][x[j] >> 6] |= UINT64_C(1) << (x[j] & 63);
+                    masked_columns[x[j]][y[j] >> 6] |=
+                        UINT64_C(1) << (y[j] & 63);
+                }
+            }
+        }
+
+        dark = 0;
+        for (i = 0; i < width; i++) {
+            dark += enc_popcount(masked_rows[i], words);
+        }
+
+        /* Every 5% off an even share of dark modules */
+        ratio = (200 * dark + width * width) / (width * width) / 2;
+        penalty = abs(ratio - 50) / 5 * PENALTY_N4;
+
+        penalty += enc_penalty_blocks(masked_rows, width, words);
+        for (i = 0; i < width && penalty < best_penalty; i++) {
+            penalty += enc_penalty_line(masked_rows[i], width, words);
+            penalty += enc_penalty_line(masked_columns[i], width, words);
+        }
+
+        if (penalty < best_penalty) {
+            best_penalty = penalty;
+            best = m;
+        }
+    }
+
+    return best;
+}
+
+/* Encode segments as a symbol of version (or the smallest larger one that fits) */
+static QRcode *enc_encode(const Segment *segments, const int count,
+                          int version, const QRecLevel level)
+{
+    Arena *arena = arena_get();
+    const size_t mark = arena_mark(arena);
+    const unsigned char *spec;
+    unsigned char *codewords, *data, *ec;
+    int width, blocks, data_size, ec_size, total, offset;
+    int i, b, k, mask, estimate = 0, previous;
+    long bits;
+    QRcode *code = NULL;
+    unsigned int format;
+    int x[2], y[2];
+
+    if (version < 0 || version > QRSPEC_VERSION_MAX || (int)level < 0 ||
+        level > QR_ECLEVEL_H) {
+        return NULL;
+    }
+
+    pthread_once(&enc_tables_once, enc_tables_init);
+
+    /* Estimate from the count fields of the smallest versions up */
+    do {
+        previous = estimate;
+        bits = enc_stream_bits(segments, count, previous, true);
+        estimate = enc_min_version((bits + 7) / 8, level);
+    } while (estimate > previous);
+
+    version = (estimate > version) ? estimate : version;
+
+    for (;;) {
+        bits = enc_stream_bits(segments, count, version, false);
+        k = enc_min_version((bits + 7) / 8, level);
+        if (k <= version) {
+            break;
+        }
+        version = k;
+    }
+
+    data_size = enc_data_codewords(version, level);
+    if (bits > (long)data_size * 8) {
+        return NULL;
+    }
+
+    spec = enc_ec_specs[version][level];
+    blocks = spec[1] + spec[3];
+    ec_size = spec[0];
+    total = data_size + blocks * ec_size;
+    width = 17 + 4 * version;
+
+    data = arena_alloc(arena, data_size);
+    ec = arena_alloc(arena, (size_t)blocks * ec_size);
+    codewords = arena_alloc(arena, total);
+    code = qr_malloc(sizeof(QRcode));
+
+    if (data == NULL || ec == NULL || codewords == NULL || code == NULL ||
+        (code->data = qr_malloc((size_t)width * width)) == NULL) {
+        free(code);
+        arena_release(arena, mark);
+        return NULL;
+    }
+
+    code->version = version;
+    code->width = width;
+
+    enc_put_data(data, data_size, segments, count, version);
+
+    /* EC codewords of every block, then both interleaved */
+    for (b = 0, offset = 0; b < blocks; b++) {
+        k = spec[2] + (b >= spec[1]);
+        enc_ec_block(data + offset, k, ec + b * ec_size, ec_size);
+        offset += k;
+    }
+
+    for (i = 0, k = 0; i <= spec[2]; i++) {
+        for (b = 0, offset = 0; b < blocks; b++) {
+            if (i < spec[2] + (b >= spec[1])) {
+                codewords[k++] = data[offset + i];
+            }
+            offset += spec[2] + (b >= spec[1]);
+        }
+    }
+    for (i = 0; i < ec_size; i++) {
+        for (b = 0; b < blocks; b++) {
+            codewords[k++] = ec[b * ec_size + i];
+        }
+    }
+
+    enc_put_function_patterns(code->data, version);
+    enc_put_codewords(code->data, width, codewords, total);
+
+    mask = enc_choose_mask(code->data, width, level, arena);
+    arena_release(arena, mark);
+
+    if (mask < 0) {
+        QRcode_free(code);
+        return NULL;
+    }
+
+    for (i = 0; i < width; i++) {
+        for (k = 0; k < width; k++) {
+            if (!(code->data[i * width + k] & MODULE_FUNCTION)) {
+                code->data[i * width + k] ^=
+                    (enc_mask_rows[mask][i % ENC_PERIOD][k >> 6] >>
+                     (k & 63)) & 1;
+            }
+        }
+    }
+
+    format = enc_format(mask, level);
+    for (i = 0; i < 15; i++) {
+        enc_format_modules(width, i, x, y);
+        code->data[y[0] * width + x[0]] =
+        code->data[y[1] * width + x[1]] = MODULE_FORMAT | ((format >> i) & 1);
+    }
+
+    return code;
+}
+
+/* Splitting strings like libqrencode */
+/*
+    A greedy split that weighs each run of digits or alphanumeric
+    characters against carrying on in the mode at hand, with the count
+    field widths of the version asked for
+*/
+static inline bool enc_is_digit(const char *p)
+{
+    return (char_classes[(unsigned char)*p] & CLASS_NUM) != 0;
+}
+
+static inline bool enc_is_an(const char *p)
+{
+    return (char_classes[(unsigned char)*p] & CLASS_AN) != 0;
+}
+
+static QRencodeMode enc_identify_mode(const char *p, const QRencodeMode hint)
+{
+    if (*p == '\0') {
+        return QR_MODE_NUL;
+    }
+    if (enc_is_digit(p)) {
+        return QR_MODE_NUM;
+    }
+    if (enc_is_an(p)) {
+        return QR_MODE_AN;
+    }
+    if (hint == QR_MODE_KANJI && p[1] != '\0' &&
+        is_kanji((const unsigned char *)p)) {
+        return QR_MODE_KANJI;
+    }
+
+    return QR_MODE_8;
+}
+
+typedef struct {
+    Segment     *segments;
+    int          count;
+    int          version;
+    QRencodeMode hint;
+} EncSplit;
+
+static int enc_eat_8(EncSplit *split, const char *str);
+static int enc_eat_an(EncSplit *split, const char *str);
+
+static int enc_split_add(EncSplit *split, const QRencodeMode mode,
+                         const char *str, const int size)
+{
+    if (size == 0) {
+        return 0;
+    }
+
+    split->segments[split->count].mode = mode;
+    split->segments[split->count].size = size;
+    split->segments[split->count].bytes = (const unsigned char *)str;
+    split->count++;
+
+    return size;
+}
+
+static int enc_eat_num(EncSplit *split, const char *str)
+{
+    const int ln = enc_count_bits(QR_MODE_NUM, split->version);
+    const char *p = str;
+    QRencodeMode mode;
+    int run;
+
+    while (enc_is_digit(p)) {
+        p++;
+    }
+
+    run = p - str;
+    mode = enc_identify_mode(p, split->hint);
+
+    if (mode == QR_MODE_8 &&
+        enc_data_bits(QR_MODE_NUM, run) + 4 + ln + enc_data_bits(QR_MODE_8, 1) -
+        enc_data_bits(QR_MODE_8, run + 1) > 0) {
+        return enc_eat_8(split, str);
+    }
+
+    if (mode == QR_MODE_AN &&
+        enc_data_bits(QR_MODE_NUM, run) + 4 + ln + enc_data_bits(QR_MODE_AN, 1) -
+        enc_data_bits(QR_MODE_AN, run + 1) > 0) {
+        return enc_eat_an(split, str);
+    }
+
+    return enc_split_add(split, QR_MODE_NUM, str, run);
+}
+
+static int enc_eat_an(EncSplit *split, const char *str)
+{
+    const int la = enc_count_bits(QR_MODE_AN, split->version);
+    const int ln = enc_count_bits(QR_MODE_NUM, split->version);
+    const char *p = str, *q;
+    int run;
+
+    while (enc_is_an(p)) {
+        if (!enc_is_digit(p)) {
+            p++;
+            continue;
+        }
+
+        for (q = p; enc_is_digit(q); q++);
+
+        /* Libqrencode charges a numeric header for the switch back */
+        if (enc_data_bits(QR_MODE_AN, p - str) +
+            enc_data_bits(QR_MODE_NUM, q - p) + 4 + ln +
+            ((enc_is_an(q)) ? 4 + ln : 0) -
+            enc_data_bits(QR_MODE_AN, q - str) < 0) {
+            break;
+        }
+
+        p = q;
+    }
+
+    run = p - str;
+
+    if (*p != '\0' && !enc_is_an(p) &&
+        enc_data_bits(QR_MODE_AN, run) + 4 + la + enc_data_bits(QR_MODE_8, 1) -
+        enc_data_bits(QR_MODE_8, run + 1) > 0) {
+        return enc_eat_8(split, str);
+    }
+
+    return enc_split_add(split, QR_MODE_AN, str, run);
+}
+
+static int enc_eat_kanji(EncSplit *split, const char *str)
+{
+    const char *p = str;
+
+    while (enc_identify_mode(p, split->hint) == QR_MODE_KANJI) {
+        p += 2;
+    }
+
+    return enc_split_add(split, QR_MODE_KANJI, str, p - str);
+}
+
+static int enc_eat_8(EncSplit *split, const char *str)
+{
+    const int la = enc_count_bits(QR_MODE_AN, split->version);
+    const int ln = enc_count_bits(QR_MODE_NUM, split->version);
+    const int l8 = enc_count_bits(QR_MODE_8, split->version);
+    const char *p = str + 1, *q;
+    QRencodeMode mode;
+    int run, bits;
+
+    while (*p != '\0') {
+        mode = enc_identify_mode(p, split->hint);
+
+        if (mode == QR_MODE_KANJI) {
+            break;
+        }
+
+        if (mode != QR_MODE_NUM && mode != QR_MODE_AN) {
+            p++;
+            continue;
+        }
+
+        /* Whether a run of digits (or alphanumerics) is worth a segment */
+        q = p;
+        if (mode == QR_MODE_NUM) {
+            while (enc_is_digit(q)) {
+                q++;
+            }
+            run = q - p;
+            bits = enc_data_bits(QR_MODE_NUM, run) + 4 + ln;
+        } else {
+            while (enc_is_an(q)) {
+                q++;
+            }
+            run = q - p;
+            bits = enc_data_bits(QR_MODE_AN, run) + 4 + la;
+        }
+
+        if (enc_identify_mode(q, split->hint) == QR_MODE_8) {
+            bits += 4 + l8;
+        }
+
+        if (enc_data_bits(QR_MODE_8, p - str) + bits -
+            enc_data_bits(QR_MODE_8, q - str) < 0) {
+            break;
+        }
+
+        p = q;
+    }
+
+    return enc_split_add(split, QR_MODE_8, str, p - str);
+}
+
+/* Split str into segments (at most one per byte); returns how many */
+static int enc_split_string(const char *str, const int version,
+                            const QRencodeMode hint, Segment *segments)
+{
+    EncSplit split = { segments, 0, (version > 0) ? version : 1, hint };
+    QRencodeMode mode;
+    int length;
+
+    while (*str != '\0') {
+        mode = enc_identify_mode(str, hint);
+
+        length = (mode == QR_MODE_NUM) ? enc_eat_num(&split, str) :
+                 (mode == QR_MODE_AN) ? enc_eat_an(&split, str) :
+                 (mode == QR_MODE_KANJI) ? enc_eat_kanji(&split, str) :
+                 enc_eat_8(&split, str);
+
+        if (length == 0) {
+            break;
+        }
+
+        str += length;
+    }
+
+    return split.count;
+}
+
+/* Same as QRcode_encodeString(), case-sensitive */
+static QRcode *enc_encode_string(const char *str, const int version,
+                                 const QRecLevel level,
+                                 const QRencodeMode hint)
+{
+    Arena *arena = arena_get();
+    const size_t mark = arena_mark(arena);
+    Segment *segments;
+    QRcode *code = NULL;
+
+    if (hint != QR_MODE_8 && hint != QR_MODE_KANJI) {
+        return NULL;
+    }
+
+    segments = arena_alloc(arena, (strlen(str) + 1) * sizeof(Segment));
+    if (segments != NULL) {
+        code = enc_encode(segments,
+                          enc_split_string(str, version, hint, segments),
+                          version, level);
+    }
+
+    arena_release(arena, mark);
+
+    return code;
+}
+
+/*
+    Segments marking data as UTF-8 (if asked to): the ECI designator, and
+    a BOM unless data starts with one already; returns how many (2 at most)
+*/
+static int seg_prefix(const QrOptions *options, const char *data,
+                      const size_t size, Segment *segments)
+{
+    int count = 0;
+
+    if (options->eci) {
+        segments[count].mode = QR_MODE_ECI;
+        segments[count].size = ECI_UTF8;
+        segments[count].bytes = NULL;
+        count++;
+    }
+
+    if (options->unicode && !data_has_utf8_bom(data, size)) {
+        segments[count].mode = QR_MODE_8;
+        segments[count].size = UTF8_BOM_SIZE;
+        segments[count].bytes = (const unsigned char *)utf8_bom;
+        count++;
+    }
+
+    return count;
+}
+
+/* Append segments to input; returns 0 on failure */
+static bool qr_input_append_list(QRinput *input, const Segment *segments,
+                                 const int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if ((segments[i].mode == QR_MODE_ECI)
+            ? QRinput_appendECIheader(input, segments[i].size) != 0
+            : QRinput_append(input, segments[i].mode, segments[i].size,
+                             segments[i].bytes) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Append what marks data as UTF-8 (see seg_prefix()); returns 0 on failure */
+static bool qr_input_append_prefix(QRinput *input, const QrOptions *options,
+                                   const char *data, const size_t size)
+{
+    Segment prefix[2];
+
+    return qr_input_append_list(input, prefix,
+                                seg_prefix(options, data, size, prefix));
+}
+
+/* Encode segments with libqrencode, counted for version at first */
+static QRcode *qr_encode_segments(const Segment *segments, const int count,
+                                  const int version, const int min_version,
+                                  const QRecLevel level)
+{
+    QRinput *input = QRinput_new2(version, level);
+    QRcode *code = NULL;
+
+    if (input == NULL) {
+        return NULL;
+    }
+
+    /* Keep the version automatic, it is only a lower bound anyway */
+    if (qr_input_append_list(input, segments, count)) {
+        QRinput_setVersion(input, min_version);
+        code = QRcode_encodeInput(input);
+    }
+
+    QRinput_free(input);
+
+    return code;
+}
+
+/*
+    Encode with the cheapest segmentation for the version it ends up with,
+    after the prefix (if any), straight from data
+*/
+static QRcode *qr_encode_segmented(const QrOptions *options, const char *data,
+                                   const size_t size)
+{
+    const QRecLevel level = get_qr_ec_level(options->ec_level);
+    const unsigned char *bytes = (const unsigned char *)data;
+    /* Input marked as UTF-8 is never read as Shift JIS */
+    const bool kanji = !options->eci && !options->unicode &&
+                       !is_utf8(bytes, size);
+    Arena *arena = arena_get();
+    const size_t mark = arena_mark(arena);
+    /* The prefix, then one segment per byte at most */
+    Segment *segments = arena_alloc(arena, (size + 2) * sizeof(Segment));
+    int version = (options->version > 0) ? options->version : 1;
+    int count, split;
+    QRcode *code = NULL;
+
+    /*
+        Wider count fields only ever cost more bits, so the version only
+        grows when the segmentation is redone for the class it landed in
+    */
+    while (segments != NULL) {
+        count = seg_prefix(options, data, size, segments);
+        split = seg_split_optimal(bytes, size, version, kanji,
+                                  segments + count);
+        if (split < 0) {
+            break;
+        }
+
+        code = (options->builtin)
+               ? enc_encode(segments, count + split, options->version, level)
+               : qr_encode_segments(segments, count + split, version,
+                                    options->version, level);
+
+        if (code == NULL ||
+            version_class(code->version) == version_class(version)) {
+            break;
+        }
+
+        version = code->version;
+        QRcode_free(code);
+        code = NULL;
+    }
+
+    arena_release(arena, mark);
+
+    return code;
+}
+
+/* Encode a NUL-terminated string as a QR or Micro QR symbol */
+static QRcode *qr_encode_string(const QrOptions *options, const char *str)
+{
+    const QRecLevel level = get_qr_ec_level(options->ec_level);
+    const QRencodeMode hint = get_qr_encode_mode(options->encode_mode);
+    QRcode *code = NULL;
+    int version;
+
+    if (!options->micro) {
+        return (options->builtin)
+               ? enc_encode_string(str, options->version, level, hint)
+               : QRcode_encodeString(str, options->version, level, hint,
+                                     true);
+    }
+
+    /* The smallest of M1-M4 that fits (and supports the EC level) */
+    for (version = (options->version > 0) ? options->version : 1;
+         code == NULL && version <= MQRSPEC_VERSION_MAX; version++) {
+        code = QRcode_encodeStringMQR(str, version, level, hint, true);
+    }
+
+    return code;
+}
+
+/* Encode size bytes of data as a Micro QR symbol in 8-bit mode */
+static QRcode *qr_encode_micro_data(const QrOptions *options,
+                                    const char *data, const size_t size)
+{
+    const QRecLevel level = get_qr_ec_level(options->ec_level);
+    const bool bom = options->unicode && !data_has_utf8_bom(data, size);
+    QRcode *code = NULL;
+    QRinput *input;
+    int version;
+
+    /* Micro QR inputs are tied to their version, so one is built for each */
+    for (version = (options->version > 0) ? options->version : 1;
+         code == NULL && version <= MQRSPEC_VERSION_MAX; version++) {
+        if (!bom) {
+            code = QRcode_encodeDataMQR(size, (const unsigned char *)data,
+                                        version, level);
+            continue;
+        }
+
+        input = QRinput_newMQR(version, level);
+        if (input == NULL) {
+            continue;
+        }
+
+        if (qr_input_append_prefix(input, options, data, size) &&
+            QRinput_append(input, QR_MODE_8, size,
+                           (const unsigned char *)data) == 0) {
+            code = QRcode_encodeInput(input);
+        }
+
+        QRinput_free(input);
+    }
+
+    return code;
+}
+
+QRcode *qr_encode(const QrOptions *options, const char *data,
+                  const size_t size)
+{
+    const bool prefix = options->eci ||
+                        (options->unicode && !data_has_utf8_bom(data, size));
+    /* Libqrencode would stop splitting a string at its first NUL */
+    const bool binary = (memchr(data, '\0', size) != NULL);
+
+    /* Micro QR count fields differ, leave its segmentation to libqrencode */
+    if (options->micro) {
+        return (prefix || binary) ? qr_encode_micro_data(options, data, size)
+                                  : qr_encode_string(options, data);
+    }
+
+    if (options->encode_mode != 'o' && options->encode_mode != 'O' &&
+        !prefix && !binary) {
+        return qr_encode_string(options, data);
+    }
+
+    /* No symbol holds more characters than that */
+    if (size > QR_DATA_MAX) {
+        return NULL;
+    }
+
+    /* The prefix and data go in as segments of their own, with no copy */
+    return qr_encode_segmented(options, data, size);
+}
+
+/* Structured append */
+/*
+    A payload too long for one symbol is cut into as few equal parts as
+    fit one each, every part segmented on its own, linked together by
+    libqrencode's structured append headers, and every part is encoded on
+    a thread of its own
+*/
+typedef struct {
+    QRinput *input;
+    QRcode  *code;
+} StructuredPart;
+
+static void *structured_part_encode(void *arg)
+{
+    StructuredPart *part = arg;
+
+    part->code = QRcode_encodeInput(part->input);
+
+    return NULL;
+}
+
+/*
+    Segment count equal parts of data (the first one after the prefix) into
+    segments, how many of them each part takes going to counts; returns 0
+    if a part would not fit a symbol of the largest version, or on failure
+*/
+static bool structured_split(const QrOptions *options, const char *data,
+                             const size_t size, const size_t count,
+                             Segment *segments, int *counts)
+{
+    const QRecLevel level = get_qr_ec_level(options->ec_level);
+    const unsigned char *bytes = (const unsigned char *)data;
+    const char mode = options->encode_mode;
+    /* As libqrencode would, see qr_encode_segmented() for 'o' */
+    const bool kanji = (mode == 'k' || mode == 'K' || mode == 'o' ||
+                        mode == 'O') &&
+                       !options->eci && !options->unicode &&
+                       !is_utf8(bytes, size);
+    const long capacity = enc_data_codewords(QRSPEC_VERSION_MAX, level) * 8 -
+                          STRUCTURED_HEADER_BITS;
+    size_t offset = 0;
+    size_t i;
+    int prefix, split;
+
+    for (i = 0; i < count; i++) {
+        const size_t part_size = size / count + (i < size % count);
+
+        prefix = (i == 0) ? seg_prefix(options, data, size, segments) : 0;
+        split = seg_split_optimal(bytes + offset, part_size,
+                                  QRSPEC_VERSION_MAX, kanji,
+                                  segments + prefix);
+
+        if (split < 0 ||
+            enc_stream_bits(segments, prefix + split, QRSPEC_VERSION_MAX,
+                            false) > capacity) {
+            return false;
+        }
+
+        counts[i] = prefix + split;
+        segments += counts[i];
+        offset += part_size;
+    }
+
+    return true;
+}
+
+int qr_encode_structured(const QrOptions *options, const char *data,
+                         const size_t size, QRcode **codes)
+{
+    const QRecLevel level = get_qr_ec_level(options->ec_level);
+    StructuredPart parts[QR_STRUCTURED_MAX];
+    pthread_t threads[QR_STRUCTURED_MAX];
+    bool started[QR_STRUCTURED_MAX];
+    int counts[QR_STRUCTURED_MAX];
+    Arena *arena = arena_get();
+    const size_t mark = arena_mark(arena);
+    /* The prefix, then one segment per byte at most */
+    Segment *segments = arena_alloc(arena, (size + 2) * sizeof(Segment));
+    const Segment *part_segments;
+    QRinput_Struct *s;
+    size_t count = 2;
+    size_t i;
+    int version = 0;
+    bool ok = true;
+
+    /* Anything that fits a single symbol does without the headers */
+    codes[0] = qr_encode(options, data, size);
+    if (codes[0] != NULL) {
+        arena_release(arena, mark);
+        return 1;
+    }
+
+    while (segments != NULL && count <= QR_STRUCTURED_MAX &&
+           !structured_split(options, data, size, count, segments, counts)) {
+        count++;
+    }
+
+    if (segments == NULL || count > QR_STRUCTURED_MAX ||
+        (s = QRinput_Struct_new()) == NULL) {
+        arena_release(arena, mark);
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        parts[i].input = NULL;
+        parts[i].code = NULL;
+    }
+
+    /* The struct takes over every input appended to it */
+    for (i = 0, part_segments = segments; i < count; i++) {
+        QRinput *input = QRinput_new2(options->version, level);
+
+        if (input == NULL ||
+            !qr_input_append_list(input, part_segments, counts[i]) ||
+            QRinput_Struct_appendInput(s, input) < 0) {
+            QRinput_free(input);
+            ok = false;
+            break;
+        }
+
+        parts[i].input = input;
+
+        part_segments += counts[i];
+    }
+
+    if (ok && QRinput_Struct_insertStructuredAppendHeaders(s) != 0) {
+        ok = false;
+    }
+
+    /* Encode the first part on this thread, and all the others alongside */
+    if (ok) {
+        for (i = 1; i < count; i++) {
+            started[i] = (pthread_create(&threads[i], NULL,
+                                         structured_part_encode,
+                                         &parts[i]) == 0);
+        }
+
+        structured_part_encode(&parts[0]);
+
+        for (i = 1; i < count; i++) {
+            if (started[i]) {
+                pthread_join(threads[i], NULL);
+            } else {
+                structured_part_encode(&parts[i]);
+            }
+        }
+    }
+
+    for (i = 0; ok && i < count; i++) {
+        if (parts[i].code == NULL) {
+            ok = false;
+        } else if (parts[i].code->version > version) {
+            version = parts[i].code->version;
+        }
+    }
+
+    /* Bring every symbol up to the same version (and size) */
+    for (i = 0; ok && i < count; i++) {
+        if (parts[i].code->version < version) {
+            QRcode_free(parts[i].code);
+            QRinput_setVersion(parts[i].input, version);
+            parts[i].code = QRcode_encodeInput(parts[i].input);
+            ok = (parts[i].code != NULL);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (ok) {
+            codes[i] = parts[i].code;
+        } else {
+            QRcode_free(parts[i].code);
+        }
+    }
+
+    QRinput_Struct_free(s);
+    arena_release(arena, mark);
+
+    return (ok) ? (int)count : 0;
+}
+
+/* Render cache */
+/*
+    Entries are addressed by a hash of the payload and every option that
+    affects the rendered text, and hold that text. Both tiers are direct
+    mapped: the memory tier is a table of heap entries, the file tier a
+    table of fixed-size slots in a shared mapping, each slot guarded by
+    a record lock while it is being read or written. A file entry larger
+    than a slot runs on into the slots after its own, where later entries
+    may overwrite it, so such entries carry a hash of their text too
+*/
+typedef struct {
+    uint64_t  hash;
+    size_t    key_size;
+    size_t    value_size;
+    char     *bytes; // Key followed by value
+} CacheEntry;
+
+typedef struct {
+    uint64_t  hash;
+    uint32_t  key_size;
+    uint32_t  value_size;
+    uint64_t  value_hash; // Only for entries spanning several slots
+} CacheSlot;
+
+struct QrCache {
+    pthread_mutex_t  lock;
+    CacheEntry      *entries;
+    size_t           entry_count;
+    int              fd;
+    unsigned char   *map;
+    size_t           map_size;
+    size_t           slot_count;
+    size_t           slot_size;
+    unsigned long    hits;
+    unsigned long    misses;
+    unsigned long    unstored;
+};
+
+static size_t cache_key_options(const QrOptions *options,
+                                unsigned char *key)
+{
+    key[0] = options->encode_mode;
+    key[1] = options->version;
+    key[2] = options->ec_level;
+    key[3] = options->large;
+    key[4] = options->compact;
+    key[5] = options->border;
+    key[6] = options->invert;
+    key[7] = options->plain;
+    key[8] = options->unicode;
+    key[9] = options->format;
+    key[10] = options->scale;
+    key[11] = options->structured;
+    key[12] = options->micro;
+    key[13] = options->minimal;
+    key[14] = options->eci;
+    key[15] = options->builtin;
+
+    return CACHE_KEY_OPTIONS;
+}
+
+static uint64_t cache_key_hash(const unsigned char *key_options,
+                               const char *data, const size_t size)
+{
+    return qr_hash(data, size,
+                   qr_hash(key_options, CACHE_KEY_OPTIONS, QR_HASH_BASIS));
+}
+
+static bool cache_file_lock_range(const int fd, const off_t start,
+                                  const off_t length, const short type)
+{
+    struct flock lock = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = start,
+        .l_len = length,
+    };
+
+    while (fcntl(fd, F_SETLKW, &lock) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool cache_file_lock(const QrCache *cache, const size_t slot,
+                            const size_t span, const short type)
+{
+    return cache_file_lock_range(cache->fd,
+                                 CACHE_FILE_HEADER + slot * cache->slot_size,
+                                 span * cache->slot_size, type);
+}
+
+/* Number of slots taken by an entry, 0 if it would run past the last one */
+static size_t cache_file_span(const QrCache *cache, const size_t slot,
+                              const size_t key_size, const size_t value_size)
+{
+    const size_t size = sizeof(CacheSlot) + key_size + value_size;
+    const size_t span = (size + cache->slot_size - 1) / cache->slot_size;
+
+    return (span <= cache->slot_count - slot) ? span : 0;
+}
+
+static bool cache_file_open(QrCache *cache, const char *path)
+{
+    struct stat st;
+    unsigned char header[CACHE_FILE_HEADER];
+    uint32_t slot_count = CACHE_FILE_SLOTS;
+    uint32_t slot_size = CACHE_FILE_SLOT_SIZE;
+    uint32_t revision = CACHE_FILE_REVISION;
+    bool ok;
+
+    cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cache->fd < 0) {
+        return false;
+    }
+
+    /*
+        Only one process at a time looks at the header, so that the store
+        is laid out once, by whoever created the file, and adopted by the
+        others; any other file is left alone
+    */
+    if (!cache_file_lock_range(cache->fd, 0, CACHE_FILE_HEADER, F_WRLCK)) {
+        return false;
+    }
+
+    ok = (fstat(cache->fd, &st) == 0);
+
+    if (ok && st.st_size == 0) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, CACHE_FILE_MAGIC, 8);
+        memcpy(header + 8, &slot_count, sizeof(slot_count));
+        memcpy(header + 12, &slot_size, sizeof(slot_size));
+        memcpy(header + 16, &revision, sizeof(revision));
+
+        ok = (ftruncate(cache->fd, CACHE_FILE_HEADER +
+                                   (off_t)slot_count * slot_size) == 0 &&
+              pwrite(cache->fd, header, sizeof(header), 0) ==
+                  sizeof(header));
+        st.st_size = CACHE_FILE_HEADER + (off_t)slot_count * slot_size;
+    } else if (ok) {
+        ok = (st.st_size >= CACHE_FILE_HEADER &&
+              pread(cache->fd, header, sizeof(header), 0) ==
+                  sizeof(header) &&
+              memcmp(header, CACHE_FILE_MAGIC, 8) == 0);
+
+        if (ok) {
+            memcpy(&slot_count, header + 8, sizeof(slot_count));
+            memcpy(&slot_size, header + 12, sizeof(slot_size));
+            memcpy(&revision, header + 16, sizeof(revision));
+        }
+    }
+
+    cache_file_lock_range(cache->fd, 0, CACHE_FILE_HEADER, F_UNLCK);
+
+    if (!ok) {
+        return false;
+    }
+
+    cache->slot_count = slot_count;
+    cache->slot_size = slot_size;
+    cache->map_size = CACHE_FILE_HEADER + (size_t)slot_count * slot_size;
+
+    /* A store written by another revision may hold different text */
+    if (revision != CACHE_FILE_REVISION || slot_count == 0 ||
+        slot_size <= sizeof(CacheSlot) ||
+        (size_t)st.st_size < cache->map_size) {
+        return false;
+    }
+
+    cache->map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, cache->fd, 0);
+    if (cache->map == MAP_FAILED) {
+        cache->map = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+QrCache *qr_cache_open(const size_t entries, const char *path)
+{
+    QrCache *cache = qr_calloc(1, sizeof(QrCache));
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->fd = -1;
+
+    if (entries > 0) {
+        cache->entries = qr_calloc(entries, sizeof(CacheEntry));
+        cache->entry_count = entries;
+
+        if (cache->entries == NULL) {
+            qr_cache_close(cache);
+            return NULL;
+        }
+    }
+
+    if (path != NULL && !cache_file_open(cache, path)) {
+        qr_cache_close(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+void qr_cache_close(QrCache *cache)
+{
+    size_t i;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    for (i = 0; i < cache->entry_count; i++) {
+        free(cache->entries[i].bytes);
+    }
+    free(cache->entries);
+
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->map_size);
+    }
+
+    if (cache->fd >= 0) {
+        close(cache->fd);
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static bool cache_entry_matches(const uint64_t hash, const size_t key_size,
+                                const char *key_bytes,
+                                const unsigned char *key_options,
+                                const char *data, const size_t size)
+{
+    return hash != 0 && key_size == CACHE_KEY_OPTIONS + size &&
+           memcmp(key_bytes, key_options, CACHE_KEY_OPTIONS) == 0 &&
+           memcmp(key_bytes + CACHE_KEY_OPTIONS, data, size) == 0;
+}
+
+static void cache_memory_put(QrCache *cache, const uint64_t hash,
+                             const unsigned char *key_options,
+                             const char *data, const size_t size,
+                             const char *text, const size_t text_size)
+{
+    CacheEntry *entry = &cache->entries[hash % cache->entry_count];
+    char *bytes = qr_malloc(CACHE_KEY_OPTIONS + size + text_size);
+
+    if (bytes == NULL) {
+        return;
+    }
+
+    memcpy(bytes, key_options, CACHE_KEY_OPTIONS);
+    memcpy(bytes + CACHE_KEY_OPTIONS, data, size);
+    memcpy(bytes + CACHE_KEY_OPTIONS + size, text, text_size);
+
+    free(entry->bytes);
+    entry->hash = hash;
+    entry->key_size = CACHE_KEY_OPTIONS + size;
+    entry->value_size = text_size;
+    entry->bytes = bytes;
+}
+
+size_t qr_cache_get(QrCache *cache, const QrOptions *options,
+                    const char *data, const size_t size, char *buffer,
+                    const size_t bufsize)
+{
+    unsigned char key_options[CACHE_KEY_OPTIONS];
+    uint64_t hash;
+    size_t found = 0;
+
+    cache_key_options(options, key_options);
+    hash = cache_key_hash(key_options, data, size);
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->entries != NULL) {
+        const CacheEntry *entry = &cache->entries[hash % cache->entry_count];
+
+        if (entry->hash == hash &&
+            cache_entry_matches(hash, entry->key_size, entry->bytes,
+                                key_options, data, size)) {
+            found = entry->value_size;
+
+            if (found <= bufsize) {
+                memcpy(buffer, entry->bytes + entry->key_size, found);
+            }
+        }
+    }
+
+    if (found == 0 && cache->map != NULL) {
+        const size_t slot = hash % cache->slot_count;
+        const unsigned char *bytes =
+            cache->map + CACHE_FILE_HEADER + slot * cache->slot_size;
+        CacheSlot header;
+        size_t span = 1;
+
+        if (cache_file_lock(cache, slot, 1, F_RDLCK)) {
+            memcpy(&header, bytes, sizeof(header));
+
+            /* Relock the whole entry if it runs on into the next slots */
+            if (header.hash == hash) {
+                const size_t entry_span = cache_file_span(
+                    cache, slot, header.key_size, header.value_size);
+
+                if (entry_span > 1) {
+                    cache_file_lock(cache, slot, 1, F_UNLCK);
+
+                    span = (cache_file_lock(cache, slot, entry_span, F_RDLCK))
+                               ? entry_span
+                               : 0;
+                    memcpy(&header, bytes, sizeof(header));
+                }
+            }
+
+            if (span > 0 && header.hash == hash &&
+                cache_file_span(cache, slot, header.key_size,
+                                header.value_size) == span &&
+                cache_entry_matches(hash, header.key_size,
+                                    (const char *)bytes + sizeof(header),
+                                    key_options, data, size)) {
+                const unsigned char *value =
+                    bytes + sizeof(header) + header.key_size;
+
+                if (span == 1 ||
+                    qr_hash(value, header.value_size, QR_HASH_BASIS) ==
+                        header.value_hash) {
+                    found = header.value_size;
+                }
+
+                if (found > 0 && found <= bufsize) {
+                    memcpy(buffer, value, found);
+
+                    /* Promote to the memory tier */
+                    if (cache->entries != NULL) {
+                        cache_memory_put(cache, hash, key_options, data, size,
+                                         buffer, found);
+                    }
+                }
+            }
+
+            if (span > 0) {
+                cache_file_lock(cache, slot, span, F_UNLCK);
+            }
+        }
+    }
+
+    /* Only count lookups that actually returned the text */
+    if (found > 0 && found <= bufsize) {
+        cache->hits++;
+    } else if (found == 0) {
+        cache->misses++;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return found;
+}
+
+void qr_cache_put(QrCache *cache, const QrOptions *options, const char *data,
+                  const size_t size, const char *text, const size_t text_size)
+{
+    unsigned char key_options[CACHE_KEY_OPTIONS];
+    uint64_t hash;
+
+    if (text_size == 0) {
+        return;
+    }
+
+    cache_key_options(options, key_options);
+    hash = cache_key_hash(key_options, data, size);
+
+    /* Hash 0 marks empty entries and slots */
+    if (hash == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->entries != NULL) {
+        cache_memory_put(cache, hash, key_options, data, size, text,
+                         text_size);
+    }
+
+    if (cache->map != NULL) {
+        const size_t slot = hash % cache->slot_count;
+        const size_t span = (CACHE_KEY_OPTIONS + size + text_size <=
+                             UINT32_MAX)
+                                ? cache_file_span(cache, slot,
+                                                  CACHE_KEY_OPTIONS + size,
+                                                  text_size)
+                                : 0;
+        unsigned char *bytes =
+            cache->map + CACHE_FILE_HEADER + slot * cache->slot_size;
+        CacheSlot header = {
+            .hash = hash,
+            .key_size = CACHE_KEY_OPTIONS + size,
+            .value_size = text_size,
+            .value_hash = 0,
+        };
+
+        if (span > 1) {
+            header.value_hash = qr_hash(text, text_size, QR_HASH_BASIS);
+        }
+
+        if (span > 0 && cache_file_lock(cache, slot, span, F_WRLCK)) {
+            memcpy(bytes, &header, sizeof(header));
+            memcpy(bytes + sizeof(header), key_options, CACHE_KEY_OPTIONS);
+            memcpy(bytes + sizeof(header) + CACHE_KEY_OPTIONS, data, size);
+            memcpy(bytes + sizeof(header) + header.key_size, text, text_size);
+
+            cache_file_lock(cache, slot, span, F_UNLCK);
+        } else {
+            cache->unstored++;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void qr_cache_stats(QrCache *cache, unsigned long *hits,
+                    unsigned long *misses, unsigned long *unstored)
+{
+    pthread_mutex_lock(&cache->lock);
+    *hits = cache->hits;
+    *misses = cache->misses;
+    *unstored = cache->unstored;
+    pthread_mutex_unlock(&cache->lock);
+}
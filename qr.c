@@ -6,60 +6,59 @@
  *
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <locale.h>
-#include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <qrencode.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
-/* STDIN read buffer chunk size */
-#define STDIN_CHUNKSIZE 64
+#include "qr.h"
 
-/* Single-module blocks (large size) */
-#define BLOCK_0 "  "
-#define BLOCK_1 "██"
-/* Single-module blocks (large size, compact mode) */
-#define BLOCK_0_C " "
-#define BLOCK_1_C "█"
-/* Double-module blocks (default size, normal mode) */
-/*
-    Module bit order: [ bottom | top ]
-*/
-#define DBL_BLOCK_00 " "
-#define DBL_BLOCK_01 "▀"
-#define DBL_BLOCK_10 "▄"
-#define DBL_BLOCK_11 "█"
-/* Quad-module blocks (default size, compact mode) */
-/*
-    Module bit order: [ bottom_right | top_right | bottom_left | top_left ]
-*/
-#define QUAD_BLOCK_0000 " "
-#define QUAD_BLOCK_0001 "▘"
-#define QUAD_BLOCK_0010 "▖"
-#define QUAD_BLOCK_0011 "▌"
-#define QUAD_BLOCK_0100 "▝"
-#define QUAD_BLOCK_1000 "▗"
-#define QUAD_BLOCK_1001 "▚"
-#define QUAD_BLOCK_1010 "▄"
-#define QUAD_BLOCK_0101 "▀"
-#define QUAD_BLOCK_O110 "▞"
-#define QUAD_BLOCK_0111 "▛"
-#define QUAD_BLOCK_1011 "▙"
-#define QUAD_BLOCK_1100 "▐"
-#define QUAD_BLOCK_1101 "▜"
-#define QUAD_BLOCK_1110 "▟"
-#define QUAD_BLOCK_1111 "█"
-
-/* ANSI terminal colors */
-#define FG_WH     "\x1b[37m"
-#define FG_DF     "\x1b[39m"
-#define BG_BK     "\x1b[40m"
-#define BG_DF     "\x1b[49m"
-#define BGBK_FGWH BG_BK FG_WH
-#define BGDF_FGDF BG_DF FG_DF
+/* Initial size of the input read buffer (doubled whenever it fills up) */
+#define INPUT_BUFSIZE 65536
+
+/* STDOUT write buffer size (streaming output) */
+#define STDOUT_BUFSIZE 65536
+
+/* Number of queued records per worker thread in batch mode */
+#define BATCH_SLOTS_PER_JOB 4
+
+/* Upper limit for the number of worker threads in batch mode */
+#define BATCH_JOBS_MAX 256
+
+/* Daemon mode request limits (header line and payload, in bytes) */
+#define REQUEST_HEADER_MAX 256
+#define REQUEST_PAYLOAD_MAX 65536
+
+/* Most QR codes in one row of a sheet */
+#define SHEET_COLUMNS_MAX 256
+
+/* Longest name of a file written in directory mode (with its NUL) */
+#define FILE_NAME_MAX 32
+
+/* Terminal width assumed when it cannot be told (in columns) */
+#define TERMINAL_WIDTH 80
+
+/* Number of entries in the in-memory render cache */
+#define CACHE_ENTRIES 4096
+
+/* Long-only options (past any character getopt_long() may return) */
+#define OPTION_STATS 256
 
 /* Newline character(s) */
 #define EOL "\n"
@@ -68,53 +67,83 @@ typedef unsigned char bool;
 #define true          1
 #define false         0
 
-/* Use binary code to represent modules when referring to blocks */
-#define B_0    0
-#define B_1    1
-#define B_00   B_0
-#define B_01   B_1
-#define B_10   2
-#define B_11   3
-#define B_0000 B_0
-#define B_0001 B_1
-#define B_0010 B_10
-#define B_0011 B_11
-#define B_0100 4
-#define B_0101 5
-#define B_0110 6
-#define B_0111 7
-#define B_1000 8
-#define B_1001 9
-#define B_1010 10
-#define B_1011 11
-#define B_1100 12
-#define B_1101 13
-#define B_1110 14
-#define B_1111 15
+/* Statistics (--stats) */
+/*
+    Every phase is timed both by the wall clock and by the CPU time of the
+    thread doing it, and summed up over all records; the wall time of each
+    record (from encoding to writing) is also kept for percentiles
+*/
+typedef enum {
+    PHASE_READ,
+    PHASE_PARSE,
+    PHASE_ENCODE,
+    PHASE_RENDER,
+    PHASE_WRITE,
+    PHASE_COUNT
+} Phase;
 
 typedef struct {
-    char  encode_mode;
-    int   version;
-    char  ec_level;
-    bool  large;
-    bool  compact;
-    short border;
-    bool  invert;
-    bool  plain;
-    bool  unicode;
+    double wall; // Nanoseconds
+    double cpu;
+} PhaseTime;
+
+typedef struct {
+    PhaseTime     phases[PHASE_COUNT];
+    int           version;
+    int           mask;    // -1 if unknown
+    int           symbols;
+    unsigned long modules;
+    size_t        bytes;
+} RecordStats;
+
+typedef struct {
+    RecordStats  total;
+    size_t       records;
+    int          version_min;
+    int          version_max;
+    double      *latencies;
+    size_t       latencies_bufsize;
+} Stats;
+
+typedef struct {
+    QrOptions qr;
+    bool  batch;
+    bool  watch;        // Redraw one QR code per record (watch mode)
+    int   sheet;        // QR codes per sheet row (0 = fit), -1 for no sheet
+    char  delimiter;
+    const char *separator;
+    const char *directory; // Write one file per record into (directory mode)
+    int   directory_fd;
+    bool  name_hash;       // Name files by a hash of the record, not its index
+    int   jobs;
+    const char *file;
+    bool  cache_memory;
+    const char *cache_file;
+    QrCache *cache;
+    const char *serve;  // Socket to listen on (daemon mode)
+    const char *remote; // Socket of a daemon to render through
+    Stats *stats;       // Timing and memory statistics (if enabled)
 } Options;
 
-/* Unicode BOM */
-const char *utf8_bom = "\xEF\xBB\xBF";
+/* Input payload, NUL-terminated and with its length tracked explicitly */
+typedef struct {
+    const char *data;
+    size_t      size;
+    char       *buffer; // Heap buffer holding data (if read)
+    size_t      mapped; // Length of the mapping holding data (if mmap'd)
+} Input;
 
 /* Help message */
 const char *help_msg =
     "Usage: qr [OPTIONS] STRING" EOL
     "  or:  cat FILE | qr [OPTIONS]" EOL
+    "  or:  qr [OPTIONS] -f FILE" EOL
+    "  or:  cat FILE | qr -B [OPTIONS]" EOL
+    "  or:  qr -S SOCKET [-C] [-K FILE]" EOL
     EOL
     "Options:" EOL
-    "  -m  QR mode       [na8k] (n = number, a = alphabet, 8 = 8-bit, "
-                                "k = Kanji)" EOL
+    "  -m  QR mode       [na8ko] (n = number, a = alphabet, 8 = 8-bit, "
+                                 "k = Kanji, o = optimal mix)" EOL
     "  -v  QR version    [1-40]" EOL
     "  -e  QR EC level   [lmqh] or [1-4]" EOL
     "  -l  use two characters per block" EOL
@@ -122,577 +151,1782 @@ const char *help_msg =
     "  -b  border width  [1-4] (the default is 1)" EOL
     "  -i  invert colors" EOL
     "  -p  force colorless output" EOL
+    "  -z  fewest bytes of colored output (for slow terminals)" EOL
     "  -u  ensure output has UTF-8 BOM" EOL
+    "  -E  mark input as UTF-8 with an ECI header" EOL
+    "  -o  output format [text|pbm|pgm|png|sixel|kitty] (the default is text)" EOL
+    "  -x  image scale   [1-32] (pixels per module, the default is 1)" EOL
+    "  -a  split input too long for one QR code into up to 16 of them (not png)" EOL
+    "  -A  same as -a, but put the QR codes side by side (text only)" EOL
+    "  -M  Micro QR Code (smallest of M1-M4 that fits, border 2 by default)" EOL
+    "  -X  encode with the built-in encoder rather than libqrencode" EOL
+    "  -B  batch mode (one QR code per line of input)" EOL
+    "  -0  batch mode (one QR code per NUL-terminated input record)" EOL
+    "  -w  watch mode (redraw only what changed for every input record)" EOL
+    "  -g  sheet mode (COLUMNS QR codes per row, 0 to fit the terminal)" EOL
+    "  -s  separator between QR codes in batch mode (the default is newline)" EOL
+    "  -d  directory mode (batch mode writing each QR code to a file in DIR)" EOL
+    "  -H  name files by a hash of the record in directory mode (not index)" EOL
+    "  -j  worker threads in batch mode [1-256] (the default is 1)" EOL
+    "  -f  read input (or batch mode records) from FILE" EOL
+    "  -C  cache rendered QR codes in memory (for repeated batch records)" EOL
+    "  -K  cache rendered QR codes in FILE (shared across invocations)" EOL
+    "  -S  run as a daemon serving requests on the Unix socket SOCKET" EOL
+    "  -Q  render through the daemon listening on the Unix socket SOCKET" EOL
+    "  --stats  print timing and memory statistics to stderr (as JSON)" EOL
     "  -h  print help info and exit" EOL
     "  -V  print version info and exit" EOL
 ;
 
-void print_help_msg(void)
-{
-    printf("%s" EOL, help_msg);
+void print_help_msg(void)
+{
+    printf("%s" EOL, help_msg);
+}
+
+void print_version(void)
+{
+    printf("qr %s" EOL, VERSION);
+}
+
+void print_error(const char *message)
+{
+    fprintf(stderr, "Error: %s" EOL, message);
+}
+
+static const char *phase_names[PHASE_COUNT] = {
+    "read", "parse", "encode", "render", "write"
+};
+
+static double clock_ns(const clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void stats_mark(PhaseTime *mark)
+{
+    mark->wall = clock_ns(CLOCK_MONOTONIC);
+    mark->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/* Start timing a phase (nothing happens unless record is set) */
+static void stats_begin(const RecordStats *record, PhaseTime *mark)
+{
+    if (record != NULL) {
+        stats_mark(mark);
+    }
+}
+
+static void stats_end(RecordStats *record, const Phase phase,
+                      const PhaseTime *mark)
+{
+    if (record != NULL) {
+        record->phases[phase].wall += clock_ns(CLOCK_MONOTONIC) - mark->wall;
+        record->phases[phase].cpu +=
+            clock_ns(CLOCK_THREAD_CPUTIME_ID) - mark->cpu;
+    }
+}
+
+static void record_stats_init(RecordStats *record)
+{
+    memset(record, 0, sizeof(*record));
+    record->version = -1;
+    record->mask = -1;
+}
+
+/* Phases that do not belong to any one record */
+static RecordStats *stats_total(const Options *options)
+{
+    return (options->stats != NULL) ? &options->stats->total : NULL;
+}
+
+static void stats_add(Stats *stats, const RecordStats *record)
+{
+    double latency = 0;
+    double *latencies;
+    int phase;
+
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        stats->total.phases[phase].wall += record->phases[phase].wall;
+        stats->total.phases[phase].cpu += record->phases[phase].cpu;
+
+        if (phase >= PHASE_ENCODE) {
+            latency += record->phases[phase].wall;
+        }
+    }
+
+    stats->total.version = record->version;
+    stats->total.mask = record->mask;
+    stats->total.symbols += record->symbols;
+    stats->total.modules += record->modules;
+    stats->total.bytes += record->bytes;
+
+    if (record->version > 0 &&
+        (stats->version_min == 0 || record->version < stats->version_min)) {
+        stats->version_min = record->version;
+    }
+    if (record->version > stats->version_max) {
+        stats->version_max = record->version;
+    }
+
+    /*
+        Percentiles are left out if memory runs out, nothing else is (and
+        this is not counted among the allocations it reports)
+    */
+    if (stats->records == stats->latencies_bufsize) {
+        latencies = realloc(stats->latencies,
+                            (stats->records * 2 + 64) * sizeof(double));
+        if (latencies != NULL) {
+            stats->latencies = latencies;
+            stats->latencies_bufsize = stats->records * 2 + 64;
+        }
+    }
+
+    if (stats->records < stats->latencies_bufsize) {
+        stats->latencies[stats->records] = latency;
+    }
+
+    stats->records++;
+}
+
+static int latency_compare(const void *a, const void *b)
+{
+    const double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted latencies, in milliseconds */
+static double latency_percentile(const double *latencies, const size_t count,
+                                 const int percentile)
+{
+    size_t rank = (count * percentile + 99) / 100;
+
+    return latencies[(rank > 0) ? rank - 1 : 0] / 1e6;
+}
+
+static void stats_print(Stats *stats, const bool batch)
+{
+    struct rusage usage;
+    long peak_rss = 0;
+    unsigned long allocs, alloc_bytes;
+    int phase;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        peak_rss = usage.ru_maxrss;
+#ifdef __APPLE__
+        peak_rss /= 1024; // Bytes rather than kilobytes
+#endif
+    }
+
+    fprintf(stderr, "{\"records\":%lu,\"phases\":{", (unsigned long)stats->records);
+
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        fprintf(stderr, "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}",
+                (phase > 0) ? "," : "", phase_names[phase],
+                stats->total.phases[phase].wall / 1e6,
+                stats->total.phases[phase].cpu / 1e6);
+    }
+
+    fprintf(stderr, "},");
+
+    if (batch) {
+        fprintf(stderr, "\"version_min\":%d,\"version_max\":%d,",
+                stats->version_min, stats->version_max);
+    } else {
+        fprintf(stderr, "\"version\":%d,\"mask\":%d,",
+                stats->total.version, stats->total.mask);
+    }
+
+    qr_alloc_stats(&allocs, &alloc_bytes);
+
+    fprintf(stderr, "\"symbols\":%d,\"modules\":%lu,\"output_bytes\":%lu,"
+                    "\"peak_rss_kb\":%ld,\"allocs\":%lu,\"alloc_bytes\":%lu",
+            stats->total.symbols, stats->total.modules,
+            (unsigned long)stats->total.bytes, peak_rss, allocs, alloc_bytes);
+
+    if (batch && stats->records > 0 &&
+        stats->records <= stats->latencies_bufsize) {
+        qsort(stats->latencies, stats->records, sizeof(double),
+              latency_compare);
+
+        fprintf(stderr, ",\"latency_ms\":{\"p50\":%.3f,\"p90\":%.3f,"
+                        "\"p99\":%.3f,\"max\":%.3f}",
+                latency_percentile(stats->latencies, stats->records, 50),
+                latency_percentile(stats->latencies, stats->records, 90),
+                latency_percentile(stats->latencies, stats->records, 99),
+                stats->latencies[stats->records - 1] / 1e6);
+    }
+
+    fprintf(stderr, "}" EOL);
+}
+
+static bool input_read_fd(Input *input, const int fd)
+{
+    struct stat st;
+    size_t bufsize = INPUT_BUFSIZE;
+    ssize_t read_size;
+    char *buffer;
+    void *map;
+
+    input->data = NULL;
+    input->size = 0;
+    input->buffer = NULL;
+    input->mapped = 0;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        /*
+            Map regular files directly, unless they fill their last page:
+            the zero-filled page tail is what NUL-terminates the data
+        */
+        if (st.st_size % sysconf(_SC_PAGESIZE) != 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (map != MAP_FAILED) {
+                input->data = map;
+                input->size = st.st_size;
+                input->mapped = st.st_size;
+                return true;
+            }
+        }
+
+        /* Read it in one go otherwise */
+        bufsize = st.st_size + 1;
+    }
+
+    /* Pipes and terminals: read into a buffer that grows geometrically */
+    input->buffer = qr_malloc(bufsize);
+
+    while (input->buffer != NULL) {
+        read_size = read(fd, input->buffer + input->size,
+                         bufsize - input->size - 1);
+
+        if (read_size == 0) {
+            break;
+        }
+
+        if (read_size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            free(input->buffer);
+            input->buffer = NULL;
+            return false;
+        }
+
+        input->size += read_size;
+
+        if (input->size == bufsize - 1) {
+            bufsize *= 2;
+            buffer = qr_realloc(input->buffer, bufsize);
+
+            if (buffer == NULL) {
+                free(input->buffer);
+            }
+
+            input->buffer = buffer;
+        }
+    }
+
+    if (input->buffer == NULL) {
+        return false;
+    }
+
+    input->buffer[input->size] = '\0';
+    input->data = input->buffer;
+
+    return true;
+}
+
+static void input_free(Input *input)
+{
+    if (input->mapped > 0) {
+        munmap((void *)input->data, input->mapped);
+    }
+
+    free(input->buffer);
+}
+
+/* Grow a text buffer to hold at least size bytes */
+static bool text_buffer_reserve(char **text, size_t *text_bufsize,
+                                const size_t size)
+{
+    size_t bufsize;
+    char *buffer;
+
+    if (size <= *text_bufsize) {
+        return true;
+    }
+
+    bufsize = (*text_bufsize * 2 > size) ? *text_bufsize * 2 : size;
+    buffer = qr_realloc(*text, bufsize);
+
+    if (buffer == NULL) {
+        return false;
+    }
+
+    *text = buffer;
+    *text_bufsize = bufsize;
+
+    return true;
+}
+
+/* Render the symbols of a structured append split into a text buffer */
+/*
+    Symbols either follow each other, joined by the separator, or have their
+    rows joined up (they all share the same version, so their rows match)
+*/
+static const char *render_qr_codes(const Options *options, QRcode **codes,
+                                   const int count, char **text,
+                                   size_t *text_bufsize, size_t *text_len)
+{
+    const size_t separator_len = strlen(options->separator);
+    char *parts[QR_STRUCTURED_MAX];
+    const char *rows[QR_STRUCTURED_MAX] = { NULL };
+    size_t total = 0;
+    size_t size;
+    const char *error = NULL;
+    int i;
+
+    *text_len = 0;
+
+    if (options->qr.structured == QR_STRUCTURED_SEQUENTIAL) {
+        for (i = 0; i < count; i++) {
+            total += qr_render_size(&options->qr, codes[i]) +
+                     ((i > 0) ? separator_len : 0);
+        }
+
+        if (!text_buffer_reserve(text, text_bufsize, total)) {
+            return "out of memory";
+        }
+
+        for (i = 0; i < count; i++) {
+            if (i > 0) {
+                memcpy(*text + *text_len, options->separator, separator_len);
+                *text_len += separator_len;
+            }
+
+            *text_len += qr_render(&options->qr, codes[i], *text + *text_len,
+                                   *text_bufsize - *text_len);
+        }
+
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        parts[i] = qr_render_text(&options->qr, codes[i]);
+        rows[i] = parts[i];
+
+        if (parts[i] == NULL) {
+            error = "failed to convert QR code data into text";
+        } else {
+            total += strlen(parts[i]);
+        }
+    }
+
+    if (error == NULL && !text_buffer_reserve(text, text_bufsize, total)) {
+        error = "out of memory";
+    }
+
+    /* Row by row, every symbol's row without its newline but the last one */
+    while (error == NULL && *rows[0] != '\0') {
+        for (i = 0; i < count; i++) {
+            const char *eol = strstr(rows[i], EOL);
+
+            size = (eol != NULL) ? (size_t)(eol - rows[i]) : strlen(rows[i]);
+            memcpy(*text + *text_len, rows[i], size);
+            *text_len += size;
+            rows[i] += size + ((eol != NULL) ? strlen(EOL) : 0);
+        }
+
+        memcpy(*text + *text_len, EOL, strlen(EOL));
+        *text_len += strlen(EOL);
+    }
+
+    for (i = 0; i < count; i++) {
+        free(parts[i]);
+    }
+
+    return error;
+}
+
+/*
+    Render into a text buffer that grows as needed, going through the render
+    cache (if enabled); returns an error message on failure
+*/
+static const char *render_qr_code(const Options *options, const char *str,
+                                  const size_t size, char **text,
+                                  size_t *text_bufsize, size_t *text_len,
+                                  RecordStats *record)
+{
+    PhaseTime mark = { 0, 0 };
+    QRcode *qr;
+    size_t len;
+
+    *text_len = 0;
+
+    if (options->cache != NULL) {
+        stats_begin(record, &mark);
+        len = qr_cache_get(options->cache, &options->qr, str, size, *text,
+                           *text_bufsize);
+
+        if (len > *text_bufsize &&
+            text_buffer_reserve(text, text_bufsize, len)) {
+            len = qr_cache_get(options->cache, &options->qr, str, size,
+                               *text, *text_bufsize);
+        }
+
+        stats_end(record, PHASE_RENDER, &mark);
+
+        if (len > 0 && len <= *text_bufsize) {
+            *text_len = len;
+            return NULL;
+        }
+    }
+
+    if (options->qr.structured != QR_STRUCTURED_NONE) {
+        QRcode *codes[QR_STRUCTURED_MAX];
+        const char *error;
+        int count, i;
+
+        stats_begin(record, &mark);
+        count = qr_encode_structured(&options->qr, str, size, codes);
+        stats_end(record, PHASE_ENCODE, &mark);
+
+        if (count == 0) {
+            return "failed to generate QR code";
+        }
+
+        if (record != NULL) {
+            record->version = codes[0]->version;
+            record->mask = qr_mask(codes[0]);
+            record->symbols = count;
+            record->modules = (unsigned long)count * codes[0]->width *
+                              codes[0]->width;
+        }
+
+        stats_begin(record, &mark);
+        error = render_qr_codes(options, codes, count, text, text_bufsize,
+                                text_len);
+        stats_end(record, PHASE_RENDER, &mark);
+
+        for (i = 0; i < count; i++) {
+            QRcode_free(codes[i]);
+        }
+
+        if (error != NULL) {
+            return error;
+        }
+    } else {
+        stats_begin(record, &mark);
+        qr = qr_encode(&options->qr, str, size);
+        stats_end(record, PHASE_ENCODE, &mark);
+
+        if (qr == NULL) {
+            return "failed to generate QR code";
+        }
+
+        if (record != NULL) {
+            record->version = qr->version;
+            record->mask = qr_mask(qr);
+            record->symbols = 1;
+            record->modules = (unsigned long)qr->width * qr->width;
+        }
+
+        stats_begin(record, &mark);
+
+        if (!text_buffer_reserve(text, text_bufsize,
+                                 qr_render_size(&options->qr, qr))) {
+            QRcode_free(qr);
+            return "out of memory";
+        }
+
+        *text_len = qr_render(&options->qr, qr, *text, *text_bufsize);
+
+        stats_end(record, PHASE_RENDER, &mark);
+
+        QRcode_free(qr);
+    }
+
+    if (options->cache != NULL) {
+        qr_cache_put(options->cache, &options->qr, str, size, *text,
+                     *text_len);
+    }
+
+    return NULL;
+}
+
+static bool output_qr_code_cached(QrStream *output, const Options *options,
+                                  const char *str, const size_t size,
+                                  char **text, size_t *text_bufsize)
+{
+    size_t text_len;
+    const char *error;
+    RecordStats stats;
+    RecordStats *record = (options->stats != NULL) ? &stats : NULL;
+    PhaseTime mark = { 0, 0 };
+    bool ok;
+
+    if (record != NULL) {
+        record_stats_init(record);
+    }
+
+    error = render_qr_code(options, str, size, text, text_bufsize,
+                           &text_len, record);
+    if (error != NULL) {
+        print_error(error);
+        return false;
+    }
+
+    stats_begin(record, &mark);
+    ok = qr_stream_write(output, *text, text_len);
+    stats_end(record, PHASE_WRITE, &mark);
+
+    if (!ok) {
+        print_error("failed to output QR code as text");
+    }
+
+    if (record != NULL) {
+        record->bytes = text_len;
+        stats_add(options->stats, record);
+    }
+
+    return ok;
+}
+
+/* Directory mode */
+/*
+    Every record goes to a file of its own, named by its index (counting from
+    1, like input lines) or by a hash of the record, so that a record seen
+    twice ends up in the same file; files are created relative to the output
+    directory, opened once, and filled in with a single write each
+*/
+static void file_name_format(const Options *options, const size_t index,
+                             const char *str, const size_t size, char *name)
+{
+    const char *extension = (options->qr.format == QR_FORMAT_TEXT)
+                                ? "txt" : qr_format_name(options->qr.format);
+    if (!options->name_hash) {
+        snprintf(name, FILE_NAME_MAX, "%08lu.%s", (unsigned long)index,
+                 extension);
+        return;
+    }
+
+    snprintf(name, FILE_NAME_MAX, "%016llx.%s",
+             (unsigned long long)qr_hash(str, size, QR_HASH_BASIS),
+             extension);
+}
+
+static bool file_write(const int directory_fd, const char *name,
+                       const char *text, const size_t text_len)
+{
+    size_t written = 0;
+    ssize_t len;
+    bool ok;
+    int fd = openat(directory_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    while (written < text_len) {
+        len = write(fd, text + written, text_len - written);
+
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (len <= 0) {
+            break;
+        }
+
+        written += len;
+    }
+
+    ok = (written == text_len);
+
+    if (close(fd) != 0) {
+        ok = false;
+    }
+
+    return ok;
+}
+
+/* Render a record and write it to its file; returns an error on failure */
+static const char *file_qr_code(const Options *options, const size_t index,
+                                const char *str, const size_t size,
+                                char **text, size_t *text_bufsize,
+                                RecordStats *record)
+{
+    char name[FILE_NAME_MAX];
+    size_t text_len;
+    const char *error;
+    PhaseTime mark = { 0, 0 };
+    bool ok;
+
+    error = render_qr_code(options, str, size, text, text_bufsize,
+                           &text_len, record);
+    if (error != NULL) {
+        return error;
+    }
+
+    file_name_format(options, index, str, size, name);
+
+    stats_begin(record, &mark);
+    ok = file_write(options->directory_fd, name, *text, text_len);
+    stats_end(record, PHASE_WRITE, &mark);
+
+    if (record != NULL) {
+        record->bytes = text_len;
+    }
+
+    return (ok) ? NULL : "failed to write QR code to file";
+}
+
+static bool output_qr_code_file(const Options *options, const size_t index,
+                                const char *str, const size_t size,
+                                char **text, size_t *text_bufsize)
+{
+    const char *error;
+    RecordStats stats;
+    RecordStats *record = (options->stats != NULL) ? &stats : NULL;
+
+    if (record != NULL) {
+        record_stats_init(record);
+    }
+
+    error = file_qr_code(options, index, str, size, text, text_bufsize,
+                         record);
+    if (error != NULL) {
+        print_error(error);
+        return false;
+    }
+
+    if (record != NULL) {
+        stats_add(options->stats, record);
+    }
+
+    return true;
+}
+
+/* Daemon mode */
+/*
+    Requests and responses share one framing, so that a connection may carry
+    any number of them back to back:
+
+        request:   "<payload size>[ <option>...]\n" <payload>
+        response:  "<status> <text size>\n" <text>
+
+    Options are single flags as accepted by qr_options_set(), each followed
+    directly by its value (if any), e.g. "5 m8 b2 c p\nHello"; status is 0
+    on success, otherwise text holds the error message
+*/
+typedef struct {
+    int     fd;
+    char   *in;       // Received bytes not yet handled
+    size_t  in_len;
+    size_t  in_bufsize;
+    char   *out;      // Response being sent
+    size_t  out_len;
+    size_t  out_pos;
+    size_t  out_bufsize;
+    char   *text;     // Render buffer
+    size_t  text_bufsize;
+} Connection;
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_handle_signal(int signal)
+{
+    (void)signal;
+    serve_stop = 1;
+}
+
+static size_t request_header_format(const QrOptions *options,
+                                    const size_t size, char *header,
+                                    const size_t header_bufsize)
+{
+    int len = snprintf(header, header_bufsize,
+                       "%lu m%c v%d e%c b%d o%s x%d%s%s%s%s%s%s%s%s%s%s" EOL,
+                       (unsigned long)size, options->encode_mode,
+                       options->version, options->ec_level, options->border,
+                       qr_format_name(options->format), options->scale,
+                       (options->large) ? " l" : "",
+                       (options->compact) ? " c" : "",
+                       (options->invert) ? " i" : "",
+                       (options->plain) ? " p" : "",
+                       (options->minimal) ? " z" : "",
+                       (options->unicode) ? " u" : "",
+                       (options->eci) ? " E" : "",
+                       (options->structured == QR_STRUCTURED_SEQUENTIAL) ?
+                           " a" :
+                       (options->structured == QR_STRUCTURED_SIDE_BY_SIDE) ?
+                           " A" : "",
+                       (options->micro) ? " M" : "",
+                       (options->builtin) ? " X" : "");
+
+    return (len > 0 && (size_t)len < header_bufsize) ? (size_t)len : 0;
+}
+
+/* Returns 0 unless the header line is well-formed */
+static bool request_header_parse(char *header, QrOptions *options,
+                                 size_t *size)
+{
+    char *token;
+    char *end;
+
+    qr_options_init(options);
+
+    *size = strtoul(header, &end, 10);
+    if (end == header || *size > REQUEST_PAYLOAD_MAX) {
+        return false;
+    }
+
+    for (token = strtok(end, " "); token != NULL; token = strtok(NULL, " ")) {
+        if (!qr_options_set(options, token[0], token + 1)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool connection_respond(Connection *conn, const int status,
+                               const char *text, const size_t text_len)
+{
+    char header[32];
+    int header_len = snprintf(header, sizeof(header), "%d %lu" EOL, status,
+                              (unsigned long)text_len);
+
+    if (!text_buffer_reserve(&conn->out, &conn->out_bufsize,
+                             header_len + text_len)) {
+        return false;
+    }
+
+    memcpy(conn->out, header, header_len);
+    memcpy(conn->out + header_len, text, text_len);
+    conn->out_len = header_len + text_len;
+    conn->out_pos = 0;
+
+    return true;
+}
+
+/*
+    Handle the first complete request buffered on the connection (if any);
+    returns 0 if the connection has to be dropped
+*/
+static bool connection_process(Connection *conn, const Options *options)
+{
+    Options request = *options;
+    char *newline = memchr(conn->in, '\n', conn->in_len);
+    size_t header_len, size, text_len;
+    char *payload;
+    char saved;
+    const char *error;
+    bool ok;
+
+    if (newline == NULL) {
+        return conn->in_len <= REQUEST_HEADER_MAX;
+    }
+
+    header_len = newline - conn->in + 1;
+    *newline = '\0';
+
+    if (header_len > REQUEST_HEADER_MAX ||
+        !request_header_parse(conn->in, &request.qr, &size)) {
+        return false;
+    }
+
+    *newline = '\n';
+
+    if (conn->in_len < header_len + size) {
+        return true;
+    }
+
+    /* NUL-terminate the payload in place for the duration of the request */
+    if (!text_buffer_reserve(&conn->in, &conn->in_bufsize,
+                             header_len + size + 1)) {
+        return false;
+    }
+
+    payload = conn->in + header_len;
+    saved = payload[size];
+    payload[size] = '\0';
+
+    if (!qr_options_valid(&request.qr)) {
+        error = "invalid options";
+    } else if (size == 0) {
+        error = "no input specified";
+    } else {
+        error = render_qr_code(&request, payload, size, &conn->text,
+                               &conn->text_bufsize, &text_len, NULL);
+    }
+
+    if (error != NULL) {
+        ok = connection_respond(conn, 1, error, strlen(error));
+    } else {
+        ok = connection_respond(conn, 0, conn->text, text_len);
+    }
+
+    payload[size] = saved;
+
+    /* Drop the request, keeping whatever has been pipelined after it */
+    conn->in_len -= header_len + size;
+    memmove(conn->in, payload + size, conn->in_len);
+
+    return ok;
+}
+
+/* Returns 0 if the connection has been closed or has to be dropped */
+static bool connection_read(Connection *conn, const Options *options)
+{
+    ssize_t read_size;
+
+    if (!text_buffer_reserve(&conn->in, &conn->in_bufsize,
+                             conn->in_len + INPUT_BUFSIZE)) {
+        return false;
+    }
+
+    read_size = read(conn->fd, conn->in + conn->in_len,
+                     conn->in_bufsize - conn->in_len);
+
+    if (read_size < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+
+    if (read_size == 0) {
+        return false;
+    }
+
+    conn->in_len += read_size;
+
+    return connection_process(conn, options);
+}
+
+/* Returns 0 if the connection has to be dropped */
+static bool connection_write(Connection *conn, const Options *options)
+{
+    ssize_t write_size = write(conn->fd, conn->out + conn->out_pos,
+                               conn->out_len - conn->out_pos);
+
+    if (write_size < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+
+    conn->out_pos += write_size;
+
+    /* Move on to the next pipelined request once the response is out */
+    if (conn->out_pos == conn->out_len) {
+        conn->out_len = 0;
+        conn->out_pos = 0;
+
+        return connection_process(conn, options);
+    }
+
+    return true;
+}
+
+static void connection_free(Connection *conn)
+{
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn->text);
+}
+
+static bool fd_set_nonblocking(const int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+static int serve_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* Replace a stale socket left behind by an earlier daemon */
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0 || !fd_set_nonblocking(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+    Serve requests until interrupted: a single poll() loop multiplexes the
+    listening socket and every connection, each connection alternating
+    between reading a request and writing its response
+*/
+static int serve(const Options *options)
+{
+    int ret = 0;
+    int listen_fd = serve_listen(options->serve);
+    struct pollfd *fds = NULL;
+    Connection *conns = NULL;
+    size_t conn_count = 0;
+    size_t conn_bufsize = 0;
+    size_t i;
+    struct sigaction action;
+
+    if (listen_fd < 0) {
+        print_error("unable to listen on socket");
+        return 1;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = serve_handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!serve_stop) {
+        /* Slot 0 is the listening socket, slot i + 1 is connection i;
+           keep room for one more connection to be accepted */
+        if (conn_count + 2 > conn_bufsize) {
+            size_t bufsize = (conn_bufsize > 0) ? conn_bufsize * 2 : 64;
+            struct pollfd *fds_new = qr_realloc(fds, bufsize *
+                                                   sizeof(struct pollfd));
+            Connection *conns_new;
+
+            if (fds_new != NULL) {
+                fds = fds_new;
+            }
+
+            conns_new = qr_realloc(conns, bufsize * sizeof(Connection));
+            if (conns_new != NULL) {
+                conns = conns_new;
+            }
+
+            if (fds_new == NULL || conns_new == NULL) {
+                print_error("out of memory");
+                ret = 1;
+                break;
+            }
+
+            conn_bufsize = bufsize;
+        }
+
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+
+        for (i = 0; i < conn_count; i++) {
+            fds[i + 1].fd = conns[i].fd;
+            fds[i + 1].events = (conns[i].out_len > 0) ? POLLOUT : POLLIN;
+        }
+
+        if (poll(fds, conn_count + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            print_error("failed to wait for connections");
+            ret = 1;
+            break;
+        }
+
+        /* Walk backwards, so that dropping a connection (moving the last
+           one into its place) leaves the ones still to be visited alone */
+        for (i = conn_count; i-- > 0;) {
+            Connection *conn = &conns[i];
+            short revents = fds[i + 1].revents;
+            bool ok = true;
+
+            if (revents & POLLOUT) {
+                ok = connection_write(conn, options);
+            } else if (revents & (POLLIN | POLLHUP)) {
+                ok = connection_read(conn, options);
+            } else if (revents & (POLLERR | POLLNVAL)) {
+                ok = false;
+            }
+
+            if (!ok) {
+                connection_free(conn);
+                conns[i] = conns[--conn_count];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+
+            if (fd >= 0) {
+                if (fd_set_nonblocking(fd)) {
+                    memset(&conns[conn_count], 0, sizeof(Connection));
+                    conns[conn_count++].fd = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < conn_count; i++) {
+        connection_free(&conns[i]);
+    }
+    free(conns);
+    free(fds);
+
+    close(listen_fd);
+    unlink(options->serve);
+
+    return ret;
+}
+
+/* Render through a daemon (see serve()) instead of in-process */
+static bool output_qr_code_remote(QrStream *output, const Options *options,
+                                  const char *str, const size_t size)
+{
+    struct sockaddr_un addr;
+    char header[REQUEST_HEADER_MAX];
+    size_t header_len;
+    char request_buffer[REQUEST_HEADER_MAX];
+    QrStream request;
+    char *text = NULL;
+    size_t text_bufsize = 0;
+    size_t text_len = 0;
+    size_t expected = 0;
+    ssize_t read_size;
+    int status = -1;
+    bool ok = false;
+    int fd;
+
+    if (strlen(options->remote) >= sizeof(addr.sun_path)) {
+        print_error("unable to connect to socket");
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, options->remote);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        print_error("unable to connect to socket");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    header_len = request_header_format(&options->qr, size, header,
+                                       sizeof(header));
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Large payloads go straight through, past the header-sized buffer */
+    qr_stream_init(&request, request_buffer, sizeof(request_buffer), fd);
+    qr_stream_write(&request, header, header_len);
+    qr_stream_write(&request, str, size);
+
+    if (header_len == 0 || !qr_stream_flush(&request)) {
+        print_error("failed to send request");
+        close(fd);
+        return false;
+    }
+
+    /* Read the response: its header line, then as much text as it says */
+    for (;;) {
+        if (!text_buffer_reserve(&text, &text_bufsize,
+                                 text_len + INPUT_BUFSIZE)) {
+            break;
+        }
+
+        read_size = read(fd, text + text_len, text_bufsize - text_len);
+
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (read_size <= 0) {
+            break;
+        }
+
+        text_len += read_size;
+
+        if (status < 0) {
+            char *newline = memchr(text, '\n', text_len);
+            unsigned long body_size;
+
+            if (newline == NULL) {
+                continue;
+            }
+
+            *newline = '\0';
+            if (sscanf(text, "%d %lu", &status, &body_size) != 2) {
+                break;
+            }
+
+            text_len -= newline - text + 1;
+            memmove(text, newline + 1, text_len);
+            expected = body_size;
+        }
+
+        if (text_len >= expected) {
+            ok = true;
+            break;
+        }
+    }
+
+    close(fd);
+
+    if (!ok) {
+        print_error("failed to receive response");
+    } else if (status != 0) {
+        fprintf(stderr, "Error: %.*s" EOL, (int)expected, text);
+        ok = false;
+    } else {
+        ok = qr_stream_write(output, text, expected);
+
+        if (!ok) {
+            print_error("failed to output QR code as text");
+        }
+    }
+
+    free(text);
+
+    return ok;
+}
+
+/*
+    Output one QR code; text is a render buffer that grows as needed, kept
+    by the caller so that it can be reused from one code to the next
+*/
+static bool output_qr_code(QrStream *output, const Options *options,
+                           const char *str, const size_t size, char **text,
+                           size_t *text_bufsize)
+{
+    QRcode *qr;
+    bool ok;
+
+    if (options->remote != NULL) {
+        return output_qr_code_remote(output, options, str, size);
+    }
+
+    /* Cached codes are rendered whole, so that they can be stored, so are
+       split ones, so that they can be laid out, and so are timed ones, so
+       that rendering and writing are told apart */
+    if (options->cache != NULL || options->stats != NULL ||
+        options->qr.structured != QR_STRUCTURED_NONE) {
+        return output_qr_code_cached(output, options, str, size, text,
+                                     text_bufsize);
+    }
+
+    qr = qr_encode(&options->qr, str, size);
+
+    /* Bail out if unable to successfully execute QRcode_encodeString() */
+    if (qr == NULL) {
+        print_error("failed to generate QR code");
+        return false;
+    }
+
+    /* Convert QR code data into text and stream it out row by row */
+    ok = qr_render_stream(&options->qr, qr, output);
+    if (!ok) {
+        print_error("failed to output QR code as text");
+    }
+
+    /* Clean up */
+    QRcode_free(qr);
+
+    return ok;
+}
+
+static int output_qr_code_batch(QrStream *output, const Options *options,
+                                FILE *records)
+{
+    int ret = 0;
+    char *record = NULL;
+    size_t record_bufsize = 0;
+    ssize_t record_len = 0;
+    size_t record_count = 0;
+    char *text = NULL;
+    size_t text_bufsize = 0;
+    PhaseTime mark = { 0, 0 };
+
+    /* One QR code per delimited record, all of them sharing one output */
+    for (;;) {
+        stats_begin(stats_total(options), &mark);
+        record_len = getdelim(&record, &record_bufsize, options->delimiter,
+                              records);
+        stats_end(stats_total(options), PHASE_READ, &mark);
+
+        if (record_len == -1) {
+            break;
+        }
+
+        if (record_len > 0 && record[record_len - 1] == options->delimiter) {
+            record[--record_len] = '\0';
+        }
+
+        /* Keep the Nth code in the Nth place, even if some records fail */
+        if (record_count++ > 0 && options->directory == NULL) {
+            qr_stream_write(output, options->separator,
+                            strlen(options->separator));
+        }
+
+        if (record_len == 0) {
+            print_error("no input specified");
+            ret = 1;
+        } else if (options->directory != NULL) {
+            if (!output_qr_code_file(options, record_count, record,
+                                     record_len, &text, &text_bufsize)) {
+                ret = 1;
+            }
+        } else if (!output_qr_code(output, options, record, record_len,
+                                   &text, &text_bufsize)) {
+            ret = 1;
+        }
+
+        if (output->failed) {
+            break;
+        }
+    }
+
+    free(record);
+    free(text);
+
+    return ret;
 }
 
-void print_version(void)
+/*
+    Number of QR codes per sheet row given on the command line (0 to fit the
+    terminal), or -1 if str is not a number of them
+*/
+static int sheet_columns_parse(const char *str)
 {
-    printf("qr %s" EOL, VERSION);
-}
+    char *end;
+    long columns;
 
-void print_error(const char *message)
-{
-    fprintf(stderr, "Error: %s" EOL, message);
-}
+    errno = 0;
+    columns = strtol(str, &end, 10);
 
-static inline bool str_has_utf8_bom(const char *string)
-{
-    return (strcmp(string, utf8_bom) == 0);
+    if (end == str || *end != '\0' || errno != 0 || columns < 0 ||
+        columns > SHEET_COLUMNS_MAX) {
+        return -1;
+    }
+
+    return (int)columns;
 }
 
-char *qr_data_to_text(const QRcode *code, const char border_width,
-                       const bool invert_colors, const bool paint,
-                       const bool large_size, const bool compact_mode)
+/* Width of the terminal output goes to, in columns */
+static int terminal_width(void)
 {
-    int ih = 0; // Horizontal index counter
-    int iv = 0; // Vertical index counter
+    struct winsize ws;
+    const char *columns = getenv("COLUMNS");
 
-    const unsigned char *data = code->data;
-
-    if (data == NULL) {
-        return NULL;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        return ws.ws_col;
     }
 
-    const int resolution = code->width;
-    const int l = resolution + border_width * 2;
-
-    char *text;
-
-    if (large_size) {
-        /*******************************************************************/
-        /* One module per block (large size and large size + compact mode) */
-        /*******************************************************************/
-
-        const char *blocks[2] = {
-            // 0
-            (invert_colors) ?
-                (compact_mode) ? BLOCK_0_C : BLOCK_0 :
-                (compact_mode) ? BLOCK_1_C : BLOCK_1,
-            // 1
-            (invert_colors) ?
-                (compact_mode) ? BLOCK_1_C : BLOCK_1 :
-                (compact_mode) ? BLOCK_0_C : BLOCK_0,
-        };
-        const char modules_per_block_v = 1;
-        const char modules_per_block_h = 1;
-
-        const int byte_len =
-            (strlen((compact_mode) ? BLOCK_1_C : BLOCK_1) * l + strlen(EOL)) * l +
-            ((paint) ? strlen(BGBK_FGWH) + strlen(BGDF_FGDF) : 0) * l;
-        text = malloc(byte_len + 1);
-        /* Move cursor to the beginning of *text */
-        text[0] = '\0';
-
-        /* Top border */
-        for (iv = 0; iv < border_width; iv += modules_per_block_v) {
-            /* Set palette */
-            if (paint) {
-                strcat(text, BGBK_FGWH);
-            }
+    if (columns != NULL && atoi(columns) > 0) {
+        return atoi(columns);
+    }
 
-            /* Append top border blocks */
-            for (ih = 0; ih < l; ih += modules_per_block_h) {
-                strcat(text, blocks[B_0]);
-            }
+    return TERMINAL_WIDTH;
+}
 
-            /* Reset palette */
-            if (paint) {
-                strcat(text, BGDF_FGDF);
-            }
+/*
+    Sheet mode: QR codes of consecutive records are laid out side by side,
+    as many per row as asked for (or as fit the terminal), and every row is
+    rendered in one go, sharing borders with its neighbours
+*/
+static int output_qr_code_sheet(QrStream *output, const Options *options,
+                                FILE *records)
+{
+    const int columns = (options->sheet > 0) ? options->sheet
+                                             : SHEET_COLUMNS_MAX;
+    const int width = (options->sheet > 0) ? 0 : terminal_width();
+    int ret = 0;
+    char *record = NULL;
+    size_t record_bufsize = 0;
+    ssize_t record_len = 0;
+    QRcode *codes[SHEET_COLUMNS_MAX + 1];
+    int count = 0;
+    int i;
+    bool top = true;
+    char *text = NULL;
+    size_t text_bufsize = 0;
+    size_t text_len;
+
+    for (;;) {
+        record_len = getdelim(&record, &record_bufsize, options->delimiter,
+                              records);
+
+        if (record_len > 0 && record[record_len - 1] == options->delimiter) {
+            record[--record_len] = '\0';
+        }
 
-            /* Put newline */
-            strcat(text, EOL);
+        if (record_len == 0) {
+            print_error("no input specified");
+            ret = 1;
+            continue;
         }
 
-        /* Left border, data, right border */
-        for (iv = 0; iv < resolution; iv += modules_per_block_v) {
-            /* Set palette */
-            if (paint) {
-                strcat(text, BGBK_FGWH);
-            }
+        if (record_len > 0) {
+            codes[count] = qr_encode(&options->qr, record, record_len);
 
-            /* Append left border blocks */
-            for (ih = 0; ih < border_width; ih += modules_per_block_h) {
-                strcat(text, blocks[B_0]);
+            if (codes[count] == NULL) {
+                print_error("failed to generate QR code");
+                ret = 1;
+                continue;
             }
+        }
+
+        /* Lay out the row once full, or once the next code would not fit */
+        if (count > 0 &&
+            (record_len == -1 || count == columns ||
+             (width > 0 &&
+              qr_sheet_width(&options->qr, codes, count + 1) > width))) {
+            text_len = qr_render_sheet(&options->qr, codes, count, top, text,
+                                       text_bufsize);
+
+            if (text_len > text_bufsize) {
+                if (!text_buffer_reserve(&text, &text_bufsize, text_len)) {
+                    print_error("out of memory");
+                    ret = 1;
+                    count += (record_len > 0);
+                    break;
+                }
 
-            /* Append data blocks */
-            for (ih = 0; ih < resolution; ih++) {
-                strcat(text, blocks[data[iv * resolution + ih] & B_1]);
+                qr_render_sheet(&options->qr, codes, count, top, text,
+                                text_bufsize);
             }
 
-            /* Append right border blocks */
-            for (ih = 0; ih < border_width; ih += modules_per_block_h) {
-                strcat(text, blocks[B_0]);
+            if (!qr_stream_write(output, text, text_len)) {
+                count += (record_len > 0);
+                break;
             }
 
-            /* Reset palette */
-            if (paint) {
-                strcat(text, BGDF_FGDF);
+            for (i = 0; i < count; i++) {
+                QRcode_free(codes[i]);
             }
 
-            /* Put newline */
-            strcat(text, EOL);
+            /* Keep the code that did not fit for the next row */
+            codes[0] = codes[count];
+            count = 0;
+            top = false;
         }
 
-        /* Bottom border */
-        for (iv = 0; iv < border_width; iv += modules_per_block_v) {
-            /* Set palette */
-            if (paint) {
-                strcat(text, BGBK_FGWH);
-            }
+        if (record_len == -1) {
+            break;
+        }
 
-            /* Append bottom border blocks */
-            for (ih = 0; ih < l; ih += modules_per_block_h) {
-                strcat(text, blocks[B_0]);
-            }
+        count++;
+    }
 
-            /* Reset palette */
-            if (paint) {
-                strcat(text, BGDF_FGDF);
-            }
+    for (i = 0; i < count; i++) {
+        QRcode_free(codes[i]);
+    }
+
+    free(record);
+    free(text);
+
+    return ret;
+}
+
+/*
+    Watch mode: every record replaces the QR code on screen, redrawing only
+    the cells that changed since the previous one
+*/
+static int output_qr_code_watch(QrStream *output, const Options *options,
+                                FILE *records)
+{
+    int ret = 0;
+    char *record = NULL;
+    size_t record_bufsize = 0;
+    ssize_t record_len = 0;
+    char *text = NULL, *previous = NULL, *update = NULL, *swap;
+    size_t text_bufsize = 0, previous_bufsize = 0, update_bufsize = 0;
+    size_t swap_bufsize;
+    size_t text_len = 0, previous_len = 0, update_len = 0;
+    bool shown = false;
+    const char *error;
+    RecordStats stats;
+    RecordStats *record_stats = (options->stats != NULL) ? &stats : NULL;
+    PhaseTime mark = { 0, 0 };
+
+    for (;;) {
+        stats_begin(stats_total(options), &mark);
+        record_len = getdelim(&record, &record_bufsize, options->delimiter,
+                              records);
+        stats_end(stats_total(options), PHASE_READ, &mark);
+
+        if (record_len == -1) {
+            break;
+        }
 
-            /* Put newline */
-            strcat(text, EOL);
+        if (record_len > 0 && record[record_len - 1] == options->delimiter) {
+            record[--record_len] = '\0';
         }
-    } else {
-        /****************************************************************/
-        /* Two or four modules per block (normal mode and compact mode) */
-        /****************************************************************/
-
-        if (compact_mode) {
-            /*****************************************/
-            /* Four modules per block (compact mode) */
-            /*****************************************/
-
-            const char *blocks[16] = {
-                (invert_colors) ? QUAD_BLOCK_0000 : QUAD_BLOCK_1111,
-                (invert_colors) ? QUAD_BLOCK_0001 : QUAD_BLOCK_1110,
-                (invert_colors) ? QUAD_BLOCK_0010 : QUAD_BLOCK_1101,
-                (invert_colors) ? QUAD_BLOCK_0011 : QUAD_BLOCK_1100,
-                (invert_colors) ? QUAD_BLOCK_0100 : QUAD_BLOCK_1011,
-                (invert_colors) ? QUAD_BLOCK_0101 : QUAD_BLOCK_1010,
-                (invert_colors) ? QUAD_BLOCK_O110 : QUAD_BLOCK_1001,
-                (invert_colors) ? QUAD_BLOCK_0111 : QUAD_BLOCK_1000,
-                (invert_colors) ? QUAD_BLOCK_1000 : QUAD_BLOCK_0111,
-                (invert_colors) ? QUAD_BLOCK_1001 : QUAD_BLOCK_O110,
-                (invert_colors) ? QUAD_BLOCK_1010 : QUAD_BLOCK_0101,
-                (invert_colors) ? QUAD_BLOCK_1011 : QUAD_BLOCK_0100,
-                (invert_colors) ? QUAD_BLOCK_1100 : QUAD_BLOCK_0011,
-                (invert_colors) ? QUAD_BLOCK_1101 : QUAD_BLOCK_0010,
-                (invert_colors) ? QUAD_BLOCK_1110 : QUAD_BLOCK_0001,
-                (invert_colors) ? QUAD_BLOCK_1111 : QUAD_BLOCK_0000,
-            };
-            const char modules_per_block_v = 2;
-            const char modules_per_block_h = 2;
-            const char border_leftover_v = (border_width % modules_per_block_v);
-            const char border_leftover_h = (border_width % modules_per_block_h);
-
-            const int byte_len =
-                (strlen(QUAD_BLOCK_1111) * l + strlen(EOL)) * l +
-                ((paint) ? strlen(BGBK_FGWH) + strlen(BGDF_FGDF) : 0) * l;
-            text = malloc(byte_len + 1);
-            /* Move cursor to the beginning of *text */
-            text[0] = '\0';
-
-            /* Top border */
-            for (iv = 0; iv < border_width - border_leftover_v; iv += modules_per_block_v) {
-                /* Set palette */
-                if (paint) {
-                    strcat(text, BGBK_FGWH);
-                }
 
-                /* Append top border quad-blocks */
-                for (ih = 0; ih < l - border_leftover_h; ih += modules_per_block_h) {
-                    strcat(text, blocks[B_0000]);
-                }
+        if (record_len == 0) {
+            print_error("no input specified");
+            ret = 1;
+            continue;
+        }
 
-                /* Trailing quad-module blocks for right border */
-                if (border_leftover_h % modules_per_block_h != 0) {
-                    /* Avoid coloring rightmost (transparent) quad-module line */
-                    if (paint && !invert_colors) {
-                        strcat(text, BG_DF);
-                    }
+        if (record_stats != NULL) {
+            record_stats_init(record_stats);
+        }
 
-                    /* Append quad-module block */
-                    strcat(text, blocks[(invert_colors) ? B_0000 : B_1100]);
-                }
+        error = render_qr_code(options, record, record_len, &text,
+                               &text_bufsize, &text_len, record_stats);
+        if (error != NULL) {
+            print_error(error);
+            ret = 1;
+            continue;
+        }
 
-                /* Reset palette */
-                if (paint) {
-                    strcat(text, BGDF_FGDF);
+        if (!shown) {
+            stats_begin(record_stats, &mark);
+            qr_stream_write(output, text, text_len);
+        } else {
+            /* Working out the update is part of rendering */
+            stats_begin(record_stats, &mark);
+            update_len = qr_render_update_into(previous, previous_len, text,
+                                               text_len, update,
+                                               update_bufsize);
+
+            if (update_len > update_bufsize) {
+                if (!text_buffer_reserve(&update, &update_bufsize,
+                                         update_len)) {
+                    print_error("out of memory");
+                    ret = 1;
+                    break;
                 }
 
-                /* Put newline */
-                strcat(text, EOL);
+                qr_render_update_into(previous, previous_len, text, text_len,
+                                      update, update_bufsize);
             }
 
-            /* Left border, data, right border */
-            for (iv = -border_leftover_v; iv < resolution; iv += modules_per_block_v) {
-                /* Set palette */
-                if (paint) {
-                    strcat(text, BGBK_FGWH);
-                }
-
-                /* Append left border quad-module blocks */
-                for (ih = 0; ih < border_width - border_leftover_h; ih += modules_per_block_h) {
-                    strcat(text, blocks[B_0000]);
-                }
+            stats_end(record_stats, PHASE_RENDER, &mark);
 
-                /* Append data quad-module blocks */
-                bool is_top_half_border_iter = (iv == -1) ? true : false;
-                bool is_last_data_row_iter = (iv == resolution - 1) ? true : false;
-                for (ih = -border_leftover_h; ih < resolution; ih += modules_per_block_h) {
-                    bool is_left_half_border_iter = (ih == -1) ? true : false;
-                    bool is_last_data_col_iter = (ih == resolution - 1) ? true : false;
-
-                    unsigned char block_mask = B_0000;
-
-                    if (is_top_half_border_iter) {
-                        if (is_left_half_border_iter) {
-                            // Able to determine bottom-right module
-                            if (data[iv * resolution + ih + resolution + 1] & 1) {
-                                block_mask += B_1000;
-                            }
-                        } else {
-                            // Can determine both of bottom modules
-                            if (data[iv * resolution + ih + resolution] & 1) {
-                                block_mask += B_0010;
-                            }
-                            if (!is_last_data_col_iter && data[iv * resolution + ih + resolution + 1] & 1) {
-                                block_mask += B_1000;
-                            }
-                        }
-                    } else {
-                        if (is_left_half_border_iter) {
-                            // Can determine both of right modules
-                            if (data[iv * resolution + ih + 1] & 1) {
-                                block_mask += B_0100;
-                            }
-                            if (!is_last_data_row_iter && data[iv * resolution + ih + resolution + 1] & 1) {
-                                block_mask += B_1000;
-                            }
-                        } else {
-                            // Can determine all modules
-                            if (data[iv * resolution + ih] & 1) {
-                                block_mask += B_0001;
-                            }
-                            if (!is_last_data_col_iter && data[iv * resolution + ih + 1] & 1) {
-                                block_mask += B_0100;
-                            }
-                            if (!is_last_data_row_iter) {
-                                if (data[iv * resolution + ih + resolution] & 1) {
-                                    block_mask += B_0010;
-                                }
-                                if (!is_last_data_col_iter && data[iv * resolution + ih + resolution + 1] & 1) {
-                                    block_mask += B_1000;
-                                }
-                            }
-                        }
-                    }
-
-                    strcat(text, blocks[block_mask]);
-                }
+            stats_begin(record_stats, &mark);
+            qr_stream_write(output, update, update_len);
+        }
 
-                /* Append right border quad-module blocks */
-                for (ih = 0; ih < border_width - border_leftover_h; ih += modules_per_block_h) {
-                    strcat(text, blocks[B_0000]);
-                }
+        /* Show every QR code as soon as it is there */
+        if (!qr_stream_flush(output)) {
+            break;
+        }
 
-                /* Trailing quad-module blocks for right border */
-                if (border_leftover_h % modules_per_block_h != 0) {
-                    /* Avoid coloring rightmost (transparent) quad-module line */
-                    if (paint && !invert_colors) {
-                        strcat(text, BG_DF);
-                    }
+        if (record_stats != NULL) {
+            stats_end(record_stats, PHASE_WRITE, &mark);
+            record_stats->bytes = (shown) ? update_len : text_len;
+            stats_add(options->stats, record_stats);
+        }
 
-                    /* Append quad-module block */
-                    strcat(text, blocks[(invert_colors) ? B_0000 : B_1100]);
-                }
+        swap = previous;
+        previous = text;
+        text = swap;
 
-                /* Reset palette */
-                if (paint) {
-                    strcat(text, BGDF_FGDF);
-                }
+        swap_bufsize = previous_bufsize;
+        previous_bufsize = text_bufsize;
+        text_bufsize = swap_bufsize;
 
-                /* Put newline */
-                strcat(text, EOL);
-            }
+        previous_len = text_len;
+        shown = true;
+    }
 
-            /* Bottom border */
-            for (iv = modules_per_block_v; iv < border_width; iv += modules_per_block_v) {
-                /* Set palette */
-                if (paint) {
-                    strcat(text, BGBK_FGWH);
-                }
+    free(record);
+    free(text);
+    free(previous);
+    free(update);
 
-                /* Append quad-module blocks */
-                for (ih = 0; ih < l - border_leftover_h; ih += modules_per_block_h) {
-                    strcat(text, blocks[B_0000]);
-                }
+    return ret;
+}
 
-                /* Trailing quad-module blocks for right border */
-                if (border_leftover_h % modules_per_block_h != 0) {
-                    /* Avoid coloring rightmost (transparent) quad-module line */
-                    if (paint && !invert_colors) {
-                        strcat(text, BG_DF);
-                    }
+/* Batch mode worker pool */
+/*
+    Records are read into a ring of slots, rendered by worker threads in
+    whatever order they finish, and written out strictly in input order
+*/
+typedef enum {
+    SLOT_FREE,
+    SLOT_QUEUED,
+    SLOT_DONE
+} BatchSlotState;
 
-                    /* Append quad-module block */
-                    strcat(text, blocks[(invert_colors) ? B_0000 : B_1100]);
-                }
+typedef struct {
+    BatchSlotState  state;
+    size_t          index;    // Record number (counting from 1)
+    char           *record;
+    size_t          record_bufsize;
+    ssize_t         record_len;
+    char           *text;
+    size_t          text_bufsize;
+    size_t          text_len;
+    const char     *error;
+    RecordStats     stats;
+} BatchSlot;
 
-                /* Reset palette */
-                if (paint) {
-                    strcat(text, BGDF_FGDF);
-                }
+typedef struct {
+    const Options   *options;
+    FILE            *records;
+    BatchSlot       *slots;
+    size_t           slot_count;
+    size_t           queued;  // Records read so far
+    size_t           claimed; // Records taken by workers so far
+    bool             eof;
+    pthread_mutex_t  lock;
+    pthread_cond_t   queued_cond;
+    pthread_cond_t   done_cond;
+} BatchPool;
+
+static void batch_slot_render(BatchSlot *slot, const Options *options)
+{
+    slot->error = NULL;
+    slot->text_len = 0;
 
-                /* Put newline */
-                strcat(text, EOL);
-            }
+    if (slot->record_len == 0) {
+        slot->error = "no input specified";
+        return;
+    }
 
-            /* Trailing quad-module blocks for bottom border */
-            if (border_leftover_v == 0 || border_leftover_v % modules_per_block_v != 0) {
-                /* Set palette */
-                if (paint) {
-                    strcat(text, BGBK_FGWH);
+    /* Each slot keeps (and grows) its own text buffer across records */
+    if (options->stats != NULL) {
+        record_stats_init(&slot->stats);
+    }
 
-                    /* Avoid coloring last (transparent) quad-module line */
-                    if (!invert_colors) {
-                        strcat(text, BG_DF);
-                    }
-                }
+    /* Files are written by the workers, as they need no ordering */
+    if (options->directory != NULL) {
+        slot->error = file_qr_code(options, slot->index, slot->record,
+                                   slot->record_len, &slot->text,
+                                   &slot->text_bufsize,
+                                   (options->stats != NULL) ? &slot->stats
+                                                            : NULL);
+        return;
+    }
 
-                /* Append quad-module blocks */
-                for (ih = 0; ih < l - border_leftover_h; ih += modules_per_block_h) {
-                    strcat(text, blocks[(invert_colors) ? B_0000 : B_1010]);
-                }
+    slot->error = render_qr_code(options, slot->record, slot->record_len,
+                                 &slot->text, &slot->text_bufsize,
+                                 &slot->text_len,
+                                 (options->stats != NULL) ? &slot->stats
+                                                          : NULL);
+}
 
-                /* Trailing quad-module blocks for right border */
-                if (border_leftover_h % modules_per_block_h != 0) {
-                    /* Avoid coloring rightmost (transparent) quad-module line */
-                    if (paint && !invert_colors) {
-                        strcat(text, BG_DF);
-                    }
+static void *batch_worker(void *arg)
+{
+    BatchPool *pool = arg;
+    BatchSlot *slot;
 
-                    /* Append quad-module block */
-                    strcat(text, blocks[(invert_colors) ? B_0000 : B_1110]);
-                }
+    pthread_mutex_lock(&pool->lock);
 
-                /* Reset palette */
-                if (paint) {
-                    strcat(text, BGDF_FGDF);
-                }
+    for (;;) {
+        while (pool->claimed == pool->queued && !pool->eof) {
+            pthread_cond_wait(&pool->queued_cond, &pool->lock);
+        }
 
-                /* Put newline */
-                strcat(text, EOL);
-            }
-        } else {
-            /***************************************/
-            /* Two modules per block (normal mode) */
-            /***************************************/
-
-            const char *blocks[4] = {
-                (invert_colors) ? DBL_BLOCK_00 : DBL_BLOCK_11,
-                (invert_colors) ? DBL_BLOCK_10 : DBL_BLOCK_01,
-                (invert_colors) ? DBL_BLOCK_01 : DBL_BLOCK_10,
-                (invert_colors) ? DBL_BLOCK_11 : DBL_BLOCK_00,
-            };
-            const char modules_per_block_v = 2;
-            const char modules_per_block_h = 1;
-            const char border_leftover_v = (border_width % modules_per_block_v);
-
-            const int byte_len =
-                (strlen(DBL_BLOCK_11) * l + strlen(EOL)) * l +
-                ((paint) ? strlen(BGBK_FGWH) + strlen(BGDF_FGDF) : 0) * l;
-            text = malloc(byte_len + 1);
-            /* Move cursor to the beginning of *text */
-            text[0] = '\0';
-
-            /* Top border */
-            for (iv = 0; iv < border_width - border_leftover_v; iv += modules_per_block_v) {
-                /* Set palette */
-                if (paint) {
-                    strcat(text, BGBK_FGWH);
-                }
+        if (pool->claimed == pool->queued) {
+            break;
+        }
 
-                /* Append top border double-module blocks */
-                for (ih = 0; ih < l; ih++) {
-                    strcat(text, blocks[B_00]);
-                }
+        slot = &pool->slots[pool->claimed++ % pool->slot_count];
 
-                /* Reset palette */
-                if (paint) {
-                    strcat(text, BGDF_FGDF);
-                }
+        pthread_mutex_unlock(&pool->lock);
+        batch_slot_render(slot, pool->options);
+        pthread_mutex_lock(&pool->lock);
 
-                /* Put newline */
-                strcat(text, EOL);
-            }
+        slot->state = SLOT_DONE;
+        pthread_cond_signal(&pool->done_cond);
+    }
 
-            /* Left border, data, right border */
-            for (iv = -border_leftover_v; iv < resolution; iv += modules_per_block_v) {
-                /* Set palette */
-                if (paint) {
-                    strcat(text, BGBK_FGWH);
-                }
+    pthread_mutex_unlock(&pool->lock);
 
-                /* Append left border double-module blocks */
-                for (ih = 0; ih < border_width; ih += modules_per_block_h) {
-                    strcat(text, blocks[B_00]);
-                }
+    return NULL;
+}
 
-                /* Append data double-module blocks */
-                bool is_top_half_border_iter = (iv == -1) ? true : false;
-                bool is_last_data_row_iter = (iv == resolution - 1) ? true : false;
-                for (ih = 0; ih < resolution; ih += modules_per_block_h) {
-                    unsigned char block_mask = B_00;
-
-                    if (is_top_half_border_iter) {
-                        if (data[iv * resolution + ih + resolution] & 1) {
-                            block_mask += B_01;
-                        }
-                    } else {
-                        if (data[iv * resolution + ih] & 1) {
-                            block_mask += B_10;
-                        }
-
-                        if (!is_last_data_row_iter && data[iv * resolution + ih + resolution] & 1) {
-                            block_mask += B_01;
-                        }
-                    }
-
-                    strcat(text, blocks[block_mask]);
-                }
+static int output_qr_code_batch_parallel(QrStream *output,
+                                         const Options *options,
+                                         FILE *records)
+{
+    int ret = 0;
+    int i;
+    int thread_count = 0;
+    size_t written = 0;
+    ssize_t record_len;
+    BatchSlot *slot;
+    PhaseTime mark = { 0, 0 };
+    pthread_t *threads = qr_calloc(options->jobs, sizeof(pthread_t));
+    BatchPool pool = {
+        .options = options,
+        .records = records,
+        .slot_count = options->jobs * BATCH_SLOTS_PER_JOB,
+        .queued = 0,
+        .claimed = 0,
+        .eof = false,
+    };
 
-                /* Append right border double-module blocks */
-                for (ih = 0; ih < border_width; ih += modules_per_block_h) {
-                    strcat(text, blocks[B_00]);
-                }
+    pool.slots = qr_calloc(pool.slot_count, sizeof(BatchSlot));
 
-                /* Reset palette */
-                if (paint) {
-                    strcat(text, BGDF_FGDF);
-                }
+    if (threads == NULL || pool.slots == NULL) {
+        print_error("out of memory");
+        free(threads);
+        free(pool.slots);
+        return 1;
+    }
 
-                /* Put newline */
-                strcat(text, EOL);
-            }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.queued_cond, NULL);
+    pthread_cond_init(&pool.done_cond, NULL);
 
-            /* Bottom border */
-            for (iv = modules_per_block_v; iv < border_width; iv += modules_per_block_v) {
-                /* Set palette */
-                if (paint) {
-                    strcat(text, BGBK_FGWH);
-                }
+    for (i = 0; i < options->jobs; i++) {
+        if (pthread_create(&threads[thread_count], NULL, batch_worker,
+                           &pool) == 0) {
+            thread_count++;
+        }
+    }
 
-                /* Append double-module blocks */
-                for (ih = 0; ih < l; ih += modules_per_block_h) {
-                    strcat(text, blocks[B_00]);
-                }
+    if (thread_count == 0) {
+        print_error("failed to start worker threads");
+        ret = 1;
+        pool.eof = true;
+    }
 
-                /* Reset palette */
-                if (paint) {
-                    strcat(text, BGDF_FGDF);
-                }
+    pthread_mutex_lock(&pool.lock);
 
-                /* Put newline */
-                strcat(text, EOL);
-            }
+    while (!pool.eof || written < pool.queued) {
+        slot = &pool.slots[written % pool.slot_count];
 
-            /* Trailing double-module blocks for bottom border */
-            {
-                /* Set palette */
-                if (paint) {
-                    strcat(text, BGBK_FGWH);
-                    /* Avoid coloring last (transparent) double-line */
-                    if (!invert_colors) {
-                        strcat(text, BG_DF);
-                    }
-                }
+        /* Reorder stage: write out finished codes in input order */
+        if (written < pool.queued && slot->state == SLOT_DONE) {
+            pthread_mutex_unlock(&pool.lock);
 
-                /* Append double-module blocks */
-                for (ih = 0; ih < l; ih += modules_per_block_h) {
-                    strcat(text, blocks[(invert_colors) ? B_00 : B_01]);
-                }
+            if (written > 0 && options->directory == NULL) {
+                qr_stream_write(output, options->separator,
+                                strlen(options->separator));
+            }
 
-                /* Reset palette */
-                if (paint) {
-                    strcat(text, BGDF_FGDF);
+            if (slot->error != NULL) {
+                print_error(slot->error);
+                ret = 1;
+            } else if (options->directory != NULL) {
+                if (options->stats != NULL) {
+                    stats_add(options->stats, &slot->stats);
                 }
-
-                /* Put newline */
-                strcat(text, EOL);
+            } else if (options->stats != NULL) {
+                stats_mark(&mark);
+                qr_stream_write(output, slot->text, slot->text_len);
+                stats_end(&slot->stats, PHASE_WRITE, &mark);
+
+                slot->stats.bytes = slot->text_len;
+                stats_add(options->stats, &slot->stats);
+            } else {
+                qr_stream_write(output, slot->text, slot->text_len);
             }
-        }
-    }
 
-    return text;
-}
+            pthread_mutex_lock(&pool.lock);
+            slot->state = SLOT_FREE;
+            written++;
 
-QRencodeMode get_qr_encode_mode(const char encode_mode)
-{
-    switch (encode_mode) {
-        case 'n':
-        case 'N':
-            return QR_MODE_NUM;
+            /* Stop reading further records once output has failed */
+            if (output->failed && !pool.eof) {
+                pool.eof = true;
+                pthread_cond_broadcast(&pool.queued_cond);
+            }
 
-        case 'a':
-        case 'A':
-            return QR_MODE_AN;
+            continue;
+        }
 
-        case '8':
-            return QR_MODE_8;
+        /* Read the next record into a free slot */
+        if (!pool.eof && pool.queued - written < pool.slot_count) {
+            slot = &pool.slots[pool.queued % pool.slot_count];
+
+            pthread_mutex_unlock(&pool.lock);
+            stats_begin(stats_total(options), &mark);
+            record_len = getdelim(&slot->record, &slot->record_bufsize,
+                                  options->delimiter, pool.records);
+            stats_end(stats_total(options), PHASE_READ, &mark);
+            if (record_len > 0 &&
+                slot->record[record_len - 1] == options->delimiter) {
+                slot->record[--record_len] = '\0';
+            }
+            pthread_mutex_lock(&pool.lock);
+
+            if (record_len == -1) {
+                pool.eof = true;
+                pthread_cond_broadcast(&pool.queued_cond);
+            } else {
+                slot->record_len = record_len;
+                slot->state = SLOT_QUEUED;
+                slot->index = ++pool.queued;
+                pthread_cond_signal(&pool.queued_cond);
+            }
 
-        case 'k':
-        case 'K':
-            return QR_MODE_KANJI;
+            continue;
+        }
 
-        default:
-            return QR_MODE_NUL;
+        pthread_cond_wait(&pool.done_cond, &pool.lock);
     }
-}
 
-QRecLevel get_qr_ec_level(const char ec_level)
-{
-    switch (ec_level) {
-        case '1':
-        case 'l':
-        case 'L':
-            return QR_ECLEVEL_L;
+    pthread_mutex_unlock(&pool.lock);
 
-        case '2':
-        case 'm':
-        case 'M':
-            return QR_ECLEVEL_M;
+    for (i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
-        case '3':
-        case 'q':
-        case 'Q':
-            return QR_ECLEVEL_Q;
+    /* Clean up */
+    for (i = 0; (size_t)i < pool.slot_count; i++) {
+        free(pool.slots[i].record);
+        free(pool.slots[i].text);
+    }
+    free(pool.slots);
+    free(threads);
 
-        case '4':
-        case 'h':
-        case 'H':
-            return QR_ECLEVEL_H;
+    pthread_cond_destroy(&pool.done_cond);
+    pthread_cond_destroy(&pool.queued_cond);
+    pthread_mutex_destroy(&pool.lock);
 
-        default:
-            return -1;
-    }
+    return ret;
 }
 
+
 int main(int argc, char *argv[])
 {
     int ret = 0;
     char *str = NULL;
+    Input input = { .data = NULL, .size = 0, .buffer = NULL, .mapped = 0 };
+    char *text = NULL;
+    size_t text_bufsize = 0;
+    FILE *records = stdin;
     int c = 0;
+    bool border_set = false;
+    bool sheet_invalid = false;
+    Stats stats = { .records = 0, .latencies = NULL };
+    bool parsed = false;
+    PhaseTime mark = { 0, 0 };
+
+    static const struct option long_options[] = {
+        { "stats", no_argument, NULL, OPTION_STATS },
+        { NULL, 0, NULL, 0 }
+    };
+
+    stats_mark(&mark);
 
     // Enable wide-character support
     char *p = setlocale(LC_ALL, "");
@@ -702,85 +1936,119 @@ int main(int argc, char *argv[])
 
     /* Default options */
     Options options = {
-        .encode_mode = '8',
-        .version = 0,
-        .ec_level = '1',
-        .large = false,
-        .compact = false,
-        .border = 1,
-        .invert = false,
-        .plain = false
+        .batch = false,
+        .watch = false,
+        .sheet = -1,
+        .delimiter = '\n',
+        .separator = EOL,
+        .directory = NULL,
+        .directory_fd = -1,
+        .name_hash = false,
+        .jobs = 1,
+        .file = NULL,
+        .cache_memory = false,
+        .cache_file = NULL,
+        .cache = NULL,
+        .serve = NULL,
+        .remote = NULL,
+        .stats = NULL
     };
+    qr_options_init(&options.qr);
 
-    /* Process STDIN (if any) */
-    if (!isatty(STDIN_FILENO)) {
-        size_t bufsize = STDIN_CHUNKSIZE;
-        str = malloc(bufsize);
-        ssize_t stdin_read_size = 0;
-        size_t total_bytes = 0;
-
-        while ((stdin_read_size = read(STDIN_FILENO, str, STDIN_CHUNKSIZE)) > 0) {
-            total_bytes += stdin_read_size;
-            bufsize += STDIN_CHUNKSIZE;
-            str = realloc(str, bufsize);
+    /* Streamed output, see qr_render_stream() */
+    static char output_buffer[STDOUT_BUFSIZE];
+    QrStream output;
+    qr_stream_init(&output, output_buffer, sizeof(output_buffer),
+                   STDOUT_FILENO);
 
-            if (str == NULL) {
-                print_error("out of memory");
+    /* Parse CLI arguments */
+    while (optind < argc) {
+        if ((c = getopt_long(argc, argv, "m:v:e:lcb:ipzuEo:x:aAMXB0wg:s:d:Hj:f:CK:S:Q:hV",
+                             long_options, NULL)) == -1) {
+            if (str != NULL) {
+                print_error("too many arguments");
+                fprintf(stderr, "%s" EOL, help_msg);
                 ret = 1;
                 goto exit;
             }
-        }
-    }
 
-    /* Parse CLI arguments */
-    while (optind < argc) {
-        if ((c = getopt(argc, argv, "m:v:e:lcb:ipuhV")) == -1) {
-            free(str);
             str = argv[optind++];
             continue;
         }
 
         switch (c) {
-            case 'm':
-                options.encode_mode = optarg[0];
+            case 'B':
+                options.batch = true;
                 break;
 
-            case 'v':
-                options.version = atoi(optarg);
+            case '0':
+                options.batch = true;
+                options.delimiter = '\0';
                 break;
 
-            case 'e':
-                options.ec_level = optarg[0];
+            case 'w':
+                options.watch = true;
                 break;
 
-            case 'l':
-                options.large = true;
+            case 'g':
+                options.sheet = sheet_columns_parse(optarg);
+                sheet_invalid = (options.sheet < 0);
                 break;
 
-            case 'c':
-                options.compact = true;
+            case 's':
+                options.separator = optarg;
                 break;
 
-            case 'b':
-                options.border = atoi(optarg);
+            case 'd':
+                options.batch = true;
+                options.directory = optarg;
                 break;
 
-            case 'i':
-                options.invert = true;
+            case 'H':
+                options.name_hash = true;
                 break;
 
-            case 'p':
-                options.plain = true;
+            case 'j':
+                options.jobs = atoi(optarg);
                 break;
 
-            case 'u':
-                options.unicode = true;
+            case 'f':
+                options.file = optarg;
+                break;
+
+            case 'C':
+                options.cache_memory = true;
+                break;
+
+            case 'K':
+                options.cache_file = optarg;
+                break;
+
+            case 'S':
+                options.serve = optarg;
+                break;
+
+            case 'Q':
+                options.remote = optarg;
+                break;
+
+            case OPTION_STATS:
+                options.stats = &stats;
                 break;
 
             case '?':
                 ret = 1;
                 goto exit;
 
+            case 'b':
+                border_set = true;
+                qr_options_set(&options.qr, c, optarg);
+                break;
+
+            default:
+                qr_options_set(&options.qr, c, optarg);
+                break;
+
             case 'h':
                 print_help_msg();
                 goto exit;
@@ -791,12 +2059,37 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* Micro QR Codes only need a 2-module quiet zone (rather than 4) */
+    if (options.qr.micro && !border_set) {
+        options.qr.border = 2;
+    }
+
     /* Validate options */
     if (
-        options.version < 0 || options.version > QRSPEC_VERSION_MAX ||
-        get_qr_ec_level(options.ec_level) < 0 ||
-        get_qr_encode_mode(options.encode_mode) == QR_MODE_NUL ||
-        options.border < 1 || options.border > 4
+        !qr_options_valid(&options.qr) ||
+        options.jobs < 1 || options.jobs > BATCH_JOBS_MAX ||
+        (options.serve != NULL && (options.batch || options.remote != NULL)) ||
+        (options.remote != NULL && options.jobs > 1) ||
+        (options.stats != NULL &&
+         (options.serve != NULL || options.remote != NULL)) ||
+        (options.watch && (options.serve != NULL || options.remote != NULL ||
+                           options.jobs > 1 ||
+                           options.qr.format != QR_FORMAT_TEXT)) ||
+        (options.directory != NULL &&
+         (options.serve != NULL || options.remote != NULL || options.watch ||
+          options.sheet >= 0 ||
+          (options.qr.structured != QR_STRUCTURED_NONE &&
+           options.qr.format != QR_FORMAT_TEXT))) ||
+        (options.name_hash && options.directory == NULL) ||
+        sheet_invalid ||
+        (options.sheet >= 0 && (options.serve != NULL ||
+                                options.remote != NULL || options.watch ||
+                                options.jobs > 1 || options.stats != NULL ||
+                                options.cache_memory ||
+                                options.cache_file != NULL ||
+                                options.qr.format != QR_FORMAT_TEXT ||
+                                options.qr.structured != QR_STRUCTURED_NONE ||
+                                options.qr.minimal))
     ) {
         print_error("invalid options");
         fprintf(stderr, "%s" EOL, help_msg);
@@ -805,20 +2098,138 @@ int main(int argc, char *argv[])
     }
 
     /* Validate arguments */
-    if (optind != argc) {
-        if (str != NULL) {
-            print_error("too many arguments");
-            fprintf(stderr, "%s" EOL, help_msg);
+    if ((options.batch || options.watch || options.sheet >= 0 ||
+         options.file != NULL || options.serve != NULL) && str != NULL) {
+        print_error("too many arguments");
+        fprintf(stderr, "%s" EOL, help_msg);
+        ret = 1;
+        goto exit;
+    }
+
+    stats_end(stats_total(&options), PHASE_PARSE, &mark);
+    parsed = true;
+
+    /* Enforce colorless output mode for non-terminal environments (files) */
+    if (!isatty(STDOUT_FILENO) || options.directory != NULL) {
+        options.qr.plain = true;
+    }
+
+    /* Open the render cache */
+    if (options.cache_memory || options.cache_file != NULL) {
+        options.cache = qr_cache_open((options.cache_memory) ? CACHE_ENTRIES
+                                                             : 0,
+                                      options.cache_file);
+
+        if (options.cache == NULL) {
+            print_error("unable to open render cache");
+            ret = 1;
+            goto exit;
+        }
+    }
+
+    /* Open the output directory (creating it if need be) */
+    if (options.directory != NULL) {
+        if (mkdir(options.directory, 0755) != 0 && errno != EEXIST) {
+            print_error("unable to create output directory");
+            ret = 1;
+            goto exit;
+        }
+
+        options.directory_fd = open(options.directory,
+                                    O_RDONLY | O_DIRECTORY);
+
+        if (options.directory_fd < 0) {
+            print_error("unable to open output directory");
+            ret = 1;
+            goto exit;
+        }
+    }
+
+    /*****************************************/
+    /* Serve requests on socket (daemon mode) */
+    /*****************************************/
+
+    if (options.serve != NULL) {
+        ret = serve(&options);
+        goto exit;
+    }
+
+    /*****************************************************/
+    /* Generate and output QR codes (batch or watch mode) */
+    /*****************************************************/
+
+    if (options.batch || options.watch || options.sheet >= 0) {
+        if (options.file != NULL) {
+            records = fopen(options.file, "r");
+
+            if (records == NULL) {
+                print_error("unable to open input file");
+                ret = 1;
+                goto exit;
+            }
+        }
+
+        if (options.watch) {
+            ret = output_qr_code_watch(&output, &options, records);
+        } else if (options.sheet >= 0) {
+            ret = output_qr_code_sheet(&output, &options, records);
+        } else if (options.jobs > 1) {
+            ret = output_qr_code_batch_parallel(&output, &options, records);
+        } else {
+            ret = output_qr_code_batch(&output, &options, records);
+        }
+
+        stats_begin(stats_total(&options), &mark);
+        if (!qr_stream_flush(&output)) {
+            print_error("failed to output QR code as text");
+            ret = 1;
+        }
+        stats_end(stats_total(&options), PHASE_WRITE, &mark);
+
+        if (records != stdin) {
+            fclose(records);
+        }
+
+        goto exit;
+    }
+
+    /* Process input file or STDIN (if any) */
+    stats_begin(stats_total(&options), &mark);
+
+    if (str != NULL) {
+        input.data = str;
+        input.size = strlen(str);
+    } else if (options.file != NULL) {
+        int fd = open(options.file, O_RDONLY);
+
+        if (fd < 0) {
+            print_error("unable to open input file");
             ret = 1;
             goto exit;
         }
 
-        str = malloc(strlen(argv[optind])+1);
-        memcpy(&str, &argv[optind], strlen(argv[optind])+1);
+        if (!input_read_fd(&input, fd)) {
+            print_error("unable to read input file");
+            ret = 1;
+        }
+
+        close(fd);
+
+        if (ret != 0) {
+            goto exit;
+        }
+    } else if (!isatty(STDIN_FILENO)) {
+        if (!input_read_fd(&input, STDIN_FILENO)) {
+            print_error("unable to read input");
+            ret = 1;
+            goto exit;
+        }
     }
 
+    stats_end(stats_total(&options), PHASE_READ, &mark);
+
     /* Check input */
-    if (str == NULL || strlen(str) == 0) {
+    if (input.data == NULL || input.size == 0) {
         print_error("no input specified");
         fprintf(stderr, EOL "%s" EOL, help_msg);
         ret = 1;
@@ -829,55 +2240,44 @@ int main(int argc, char *argv[])
     /* Generate and output QR code */
     /*******************************/
 
-    QRcode *qr;
-
-    if (options.unicode && !str_has_utf8_bom(str)) {
-        /* Prepend UTF-8 BOM to the input string */
-        char str_utf8[strlen(utf8_bom) + strlen(str) + 1];
-        memset(str_utf8, '\0', sizeof(str_utf8));
-        strncpy(str_utf8, utf8_bom, sizeof(str_utf8));
-        strncat(str_utf8, str, sizeof(str_utf8));
-        str_utf8[strlen(utf8_bom) + strlen(str)] = '\0';
-        qr = QRcode_encodeString(str_utf8, options.version,
-                                 get_qr_ec_level(options.ec_level),
-                                 get_qr_encode_mode(options.encode_mode), true);
-    } else {
-        qr = QRcode_encodeString(str, options.version,
-                                 get_qr_ec_level(options.ec_level),
-                                 get_qr_encode_mode(options.encode_mode), true);
+    if (!output_qr_code(&output, &options, input.data, input.size, &text,
+                        &text_bufsize)) {
+        ret = 1;
     }
 
-    /* Bail out if unable to successfully execute QRcode_encodeString() */
-    if (qr == NULL) {
-        print_error("failed to generate QR code");
+    stats_begin(stats_total(&options), &mark);
+    if (!qr_stream_flush(&output)) {
         ret = 1;
-        goto exit;
     }
+    stats_end(stats_total(&options), PHASE_WRITE, &mark);
 
-    /* Enforce colorless output mode for non-terminal environments */
-    if (!isatty(STDOUT_FILENO)) {
-        options.plain = true;
-    }
+exit:
+    input_free(&input);
+    free(text);
 
-    /* Convert QR code data into text */
-    char *qr_code_text = qr_data_to_text(qr, options.border, options.invert,
-                                 !options.plain, options.large,
-                                 options.compact);
+    if (options.cache != NULL) {
+        unsigned long hits, misses, unstored;
 
-    /* Output QR code as text */
-    if (qr_code_text) {
-        printf("%s", qr_code_text);
-    } else {
-        print_error("failed to convert QR code data into text");
-        ret = 1;
+        qr_cache_stats(options.cache, &hits, &misses, &unstored);
+        if (unstored > 0) {
+            fprintf(stderr, "Cache: %lu hits, %lu misses, %lu not stored" EOL,
+                    hits, misses, unstored);
+        } else {
+            fprintf(stderr, "Cache: %lu hits, %lu misses" EOL, hits, misses);
+        }
+
+        qr_cache_close(options.cache);
     }
 
-    /* Clean up */
-    if (qr != NULL) {
-        QRcode_free(qr);
+    if (options.directory_fd >= 0) {
+        close(options.directory_fd);
     }
-    free(qr_code_text);
 
-exit:
+    if (options.stats != NULL && parsed) {
+        stats_print(&stats, options.batch || options.watch);
+    }
+
+    free(stats.latencies);
+
     return ret;
 }
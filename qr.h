@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: CC0-1.0
+
+/*
+ * QR Code is a registered trademark of DENSO WAVE INCORPORATED in Japan
+ * and other countries.
+ *
+ */
+
+#ifndef QR_H
+#define QR_H
+
+#include <qrencode.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Output formats */
+typedef enum {
+    QR_FORMAT_TEXT,  // Unicode blocks (with ANSI colors unless plain)
+    QR_FORMAT_PBM,   // Binary PBM (P4)
+    QR_FORMAT_PGM,   // Binary PGM (P5)
+    QR_FORMAT_PNG,   // 1-bit grayscale PNG
+    QR_FORMAT_SIXEL, // Sixel graphics (run-length encoded)
+    QR_FORMAT_KITTY, // Kitty graphics protocol (PNG in base64)
+    QR_FORMAT_COUNT
+} QrFormat;
+
+/* Structured append: how symbols of a split payload are laid out */
+typedef enum {
+    QR_STRUCTURED_NONE,        // Never split, fail if the payload is too long
+    QR_STRUCTURED_SEQUENTIAL,  // One after another
+    QR_STRUCTURED_SIDE_BY_SIDE // Next to each other (text only)
+} QrStructured;
+
+/* Maximum number of symbols a payload may be split into */
+#define QR_STRUCTURED_MAX 16
+
+/* Encoding and rendering options (see qr_options_init()) */
+typedef struct {
+    char          encode_mode; // [na8ko] (o = optimal segmentation)
+    int           version;     // [0-40] (0 = smallest that fits)
+    char          ec_level;    // [lmqh] or [1-4]
+    unsigned char large;       // One module per character
+    unsigned char compact;     // Single-column (or quad-module) blocks
+    short         border;      // [1-4]
+    unsigned char invert;      // Dark modules on light background
+    unsigned char plain;       // No ANSI color codes
+    unsigned char unicode;     // Prepend UTF-8 BOM to the input
+    QrFormat      format;      // Output format
+    short         scale;       // [1-32] pixels per module (raster formats)
+    QrStructured  structured;  // Split payloads that do not fit one symbol
+    unsigned char micro;       // Micro QR (version is then M1-M4)
+    unsigned char minimal;     // Fewest bytes of colored text (unless plain)
+    unsigned char eci;         // Mark the input as UTF-8 with an ECI header
+    unsigned char builtin;     // Built-in encoder rather than libqrencode
+} QrOptions;
+
+/* Buffered output, flushed to fd between rendered rows */
+typedef struct {
+    char          *buffer;
+    size_t         length;
+    size_t         capacity;
+    int            fd;
+    unsigned char  failed;
+} QrStream;
+
+/* Set default options */
+void qr_options_init(QrOptions *options);
+
+/* Apply a single command-line flag ([mvelcbipuoxaAMzEX]); returns 0 if unknown */
+int qr_options_set(QrOptions *options, const int flag, const char *value);
+
+/* Returns 0 if options are out of range */
+int qr_options_valid(const QrOptions *options);
+
+/* Name of a format, as accepted by the o flag */
+const char *qr_format_name(const QrFormat format);
+
+QRencodeMode get_qr_encode_mode(const char encode_mode);
+QRecLevel get_qr_ec_level(const char ec_level);
+
+/*
+    Encode size bytes of NUL-terminated data, which may hold NULs of its own
+    (free with QRcode_free())
+*/
+QRcode *qr_encode(const QrOptions *options, const char *data,
+                  const size_t size);
+
+/* Mask pattern the encoder picked (-1 if unreadable) */
+int qr_mask(const QRcode *code);
+
+/*
+    Encode size bytes of NUL-terminated data into as many symbols as it
+    takes (up to QR_STRUCTURED_MAX, all of the same version) linked by
+    structured append headers, encoding them in parallel; codes must have
+    room for QR_STRUCTURED_MAX of them, returns how many were stored (0 on
+    failure)
+*/
+int qr_encode_structured(const QrOptions *options, const char *data,
+                         const size_t size, QRcode **codes);
+
+/* Exact size of the rendered text or image (not counting any terminating NUL) */
+size_t qr_render_size(const QrOptions *options, const QRcode *code);
+
+/*
+    Render into a caller-supplied buffer without allocating any memory
+    (except for minimal text, which is worked out from the usual text);
+    returns the full size of the text, which only got written completely
+    if it does not exceed bufsize (no terminating NUL is written)
+*/
+size_t qr_render(const QrOptions *options, const QRcode *code, char *buffer,
+                 const size_t bufsize);
+
+/* Render into a newly allocated NUL-terminated string (free with free()) */
+char *qr_render_text(const QrOptions *options, const QRcode *code);
+
+/*
+    Text taking a terminal from showing previous (cursor on the line below
+    it) to showing text, rendered with the same options: only the cells
+    that differ get redrawn, through relative cursor movements, unless
+    clearing it all and writing text again is shorter; returns a newly
+    allocated NUL-terminated string of update_size bytes (free with free())
+*/
+char *qr_render_update(const char *previous, const size_t previous_size,
+                       const char *text, const size_t size,
+                       size_t *update_size);
+
+/*
+    Same as qr_render_update(), into a caller-supplied buffer: returns the
+    full size of the update, which only got written if it does not exceed
+    bufsize (no terminating NUL is written)
+*/
+size_t qr_render_update_into(const char *previous, const size_t previous_size,
+                             const char *text, const size_t size,
+                             char *buffer, const size_t bufsize);
+
+/*
+    Render count codes as one row of a sheet of text: side by side, aligned
+    at the top and one border width apart, with the border around them all
+    but on top unless top_border is set (so that rows below share the one
+    above them); takes text format options (but for minimal), same buffer
+    contract as qr_render()
+*/
+size_t qr_render_sheet(const QrOptions *options, QRcode *const *codes,
+                       const int count, const int top_border, char *buffer,
+                       const size_t bufsize);
+
+/* Width of that row of a sheet, in columns of characters */
+int qr_sheet_width(const QrOptions *options, QRcode *const *codes,
+                   const int count);
+
+/* Set up a stream writing to fd through capacity bytes of buffer */
+void qr_stream_init(QrStream *stream, char *buffer, const size_t capacity,
+                    const int fd);
+
+/* Returns 0 once the stream has failed to write */
+int qr_stream_write(QrStream *stream, const char *bytes, const size_t size);
+int qr_stream_flush(QrStream *stream);
+
+/* Render row by row into a stream (flushed whenever a row may not fit) */
+int qr_render_stream(const QrOptions *options, const QRcode *code,
+                     QrStream *stream);
+
+/* Render cache (see qr_cache_open()) */
+typedef struct QrCache QrCache;
+
+/*
+    Open a cache of rendered text with a memory tier of entries (0 for none)
+    and a file tier in the store at path (NULL for none); returns NULL on
+    failure (or a store from another revision), thread-safe, and the store
+    may be shared by several processes
+*/
+QrCache *qr_cache_open(const size_t entries, const char *path);
+void qr_cache_close(QrCache *cache);
+
+/*
+    Look up the text rendered from size bytes of data with options; returns
+    its size (0 on miss), and only copied it if it did not exceed bufsize
+*/
+size_t qr_cache_get(QrCache *cache, const QrOptions *options,
+                    const char *data, const size_t size, char *buffer,
+                    const size_t bufsize);
+void qr_cache_put(QrCache *cache, const QrOptions *options, const char *data,
+                  const size_t size, const char *text, const size_t text_size);
+/* Lookups that returned text or missed, and texts too large for the file */
+void qr_cache_stats(QrCache *cache, unsigned long *hits,
+                    unsigned long *misses, unsigned long *unstored);
+
+/* Heap allocation, counted in qr_alloc_stats() (free with free()) */
+void *qr_malloc(const size_t size);
+void *qr_calloc(const size_t count, const size_t size);
+void *qr_realloc(void *ptr, const size_t size);
+
+/*
+    Heap allocations made so far and the bytes they asked for, not counting
+    libqrencode's or libc's own; scratch memory comes from an arena of each
+    thread, so encoding and rendering (into a caller-supplied buffer) codes
+    no larger than ones that thread did before allocates nothing
+*/
+void qr_alloc_stats(unsigned long *allocs, unsigned long *bytes);
+
+/* 64-bit FNV-1a of size bytes, continuing from hash (QR_HASH_BASIS at first) */
+#define QR_HASH_BASIS UINT64_C(0xCBF29CE484222325)
+uint64_t qr_hash(const void *bytes, const size_t size, uint64_t hash);
+
+char *qr_data_to_text(const QRcode *code, const char border_width,
+                      const unsigned char invert_colors,
+                      const unsigned char paint,
+                      const unsigned char large_size,
+                      const unsigned char compact_mode);
+
+#endif